@@ -0,0 +1,9 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// just enough of the Arduino core for the host benchmarks in bench/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,26 @@
+#ifndef HOST_SDFAT_H
+#define HOST_SDFAT_H
+
+// SdFat's block device interface as the ESP8266 core builds it with
+// USE_BLOCK_DEVICE_INTERFACE, for the host benchmarks in bench/
+#include <stdint.h>
+#include <stddef.h>
+
+namespace sdfat	{
+
+class FsBlockDeviceInterface	{
+public:
+	virtual ~FsBlockDeviceInterface() {}
+	virtual bool isBusy() = 0;
+	virtual bool readSector(uint32_t sector, uint8_t *dst) = 0;
+	virtual bool readSectors(uint32_t sector, uint8_t *dst, size_t ns) = 0;
+	virtual bool syncDevice() = 0;
+	virtual bool writeSector(uint32_t sector, const uint8_t *src) = 0;
+	virtual bool writeSectors(uint32_t sector, const uint8_t *src, size_t ns) = 0;
+};
+
+typedef FsBlockDeviceInterface FsBlockDevice;
+
+}
+
+#endif // HOST_SDFAT_H
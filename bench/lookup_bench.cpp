@@ -0,0 +1,88 @@
+// Host benchmark of the request method and content type lookups of
+// src/DavLookup.h against the if-chains they replaced. Build and run:
+//
+//	g++ -O2 -std=c++14 -DWEBDAV_PRINT_MIME_TYPES bench/lookup_bench.cpp -o lookup_bench && ./lookup_bench
+//
+// Both sides are checked to give the same answers before they are timed.
+
+#include <stdio.h>
+#include <chrono>
+#include "../src/DavLookup.h"
+
+// what handleRequest() compared before the tables, in its order: the
+// methods that drop cached listings, then the handlers
+static DavMethod oldMethod(const char *m)	{
+	static const char * const invalidating[] = { "PUT", "MKCOL", "MOVE", "COPY", "DELETE", "PROPPATCH" };
+	static const struct { const char *name; DavMethod id; } chain[] = {
+		{ "PROPFIND", METHOD_PROPFIND }, { "GET", METHOD_GET }, { "GET", METHOD_GET }, { "GET", METHOD_GET },
+		{ "HEAD", METHOD_HEAD }, { "OPTIONS", METHOD_OPTIONS }, { "POST", METHOD_POST }, { "PUT", METHOD_PUT },
+		{ "PUT", METHOD_PUT }, { "LOCK", METHOD_LOCK }, { "UNLOCK", METHOD_UNLOCK }, { "PROPPATCH", METHOD_PROPPATCH },
+		{ "MKCOL", METHOD_MKCOL }, { "MOVE", METHOD_MOVE }, { "COPY", METHOD_COPY }, { "DELETE", METHOD_DELETE },
+		{ "POST", METHOD_POST },
+	};
+
+	volatile bool invalidate = false;
+	for(size_t i = 0; i < sizeof(invalidating) / sizeof(invalidating[0]); i++)
+		if(!strcmp(m, invalidating[i]))	{
+			invalidate = true;
+			break;
+		}
+	(void) invalidate;
+
+	for(size_t i = 0; i < sizeof(chain) / sizeof(chain[0]); i++)
+		if(!strcmp(m, chain[i].name))
+			return chain[i].id;
+	return METHOD_UNKNOWN;
+}
+
+// getMimeType() before the table, every type compared in turn
+static const char *oldMimeType(const char *ext)	{
+	for(size_t i = 0; i < numMimeTypes; i++)
+		if(!strcasecmp(ext, mimeTypes[i].ext))
+			return mimeTypes[i].type;
+	return NULL;
+}
+
+// a folder view in Windows Explorer and a slicer upload, roughly
+static const char * const methods[] = { "PROPFIND", "PROPFIND", "PROPFIND", "GET", "GET", "HEAD", "OPTIONS", "PUT",
+	"LOCK", "UNLOCK", "PROPPATCH", "DELETE", "MOVE", "MKCOL", "POST", "PATCH" };
+static const char * const exts[] = { "gcode", "GCODE", "gco", "txt", "html", "js", "css", "png", "jpg", "stl",
+	"3mf", "json", "zip", "bin", "ini", "woff2" };
+
+#define NUM_METHODS		(sizeof(methods) / sizeof(methods[0]))
+#define NUM_EXTS		(sizeof(exts) / sizeof(exts[0]))
+#define ROUNDS			2000000
+
+template<typename T, typename F> static double perSecond(const char * const *in, size_t n, F lookup, T *sink)	{
+	auto start = std::chrono::steady_clock::now();
+	for(int r = 0; r < ROUNDS; r++)
+		for(size_t i = 0; i < n; i++)
+			*sink = lookup(in[i]);
+	std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+	return (double) ROUNDS * n / secs.count();
+}
+
+int main()	{
+	for(size_t i = 0; i < NUM_METHODS; i++)
+		if(oldMethod(methods[i]) != parseMethod(methods[i]))	{
+			printf("method %s differs\n", methods[i]);
+			return 1;
+		}
+	for(size_t i = 0; i < NUM_EXTS; i++)
+		if(oldMimeType(exts[i]) != lookupMimeType(exts[i]))	{
+			printf("type of %s differs\n", exts[i]);
+			return 1;
+		}
+
+	volatile DavMethod methodSink;
+	const char * volatile typeSink;
+	double oldM = perSecond(methods, NUM_METHODS, oldMethod, &methodSink);
+	double newM = perSecond(methods, NUM_METHODS, parseMethod, &methodSink);
+	double oldT = perSecond(exts, NUM_EXTS, oldMimeType, &typeSink);
+	double newT = perSecond(exts, NUM_EXTS, lookupMimeType, &typeSink);
+
+	printf("%-14s %12s %12s %8s\n", "lookup", "chain M/s", "table M/s", "speedup");
+	printf("%-14s %12.1f %12.1f %7.1fx\n", "method", oldM / 1e6, newM / 1e6, newM / oldM);
+	printf("%-14s %12.1f %12.1f %7.1fx\n", "content type", oldT / 1e6, newT / 1e6, newT / oldT);
+	return 0;
+}
@@ -0,0 +1,398 @@
+// Host simulation that picks PUT_RAW_THRESHOLD in src/ESPWebDAV.h. A corpus
+// of uploads of mixed sizes is stored on a model of a card that has been in
+// use for a while, once per candidate threshold: bodies up to it through
+// SdFat's file API, bigger ones as raw writes into a contiguous file. The
+// sector I/O goes through src/SectorCache.cpp onto a device that adds up
+// the card time of each command. Every file is read back once by a GET,
+// one multi block read per extent. Build and run:
+//
+//	g++ -O2 -std=c++14 -Ibench/host -Isrc bench/put_threshold_bench.cpp src/SectorCache.cpp -o put_threshold_bench && ./put_threshold_bench
+//
+// The volume follows SdFat 2: one cached FAT and one cached data sector,
+// new clusters taken from the search start, contiguous ones found by a scan
+// that leaves the search start in front of any hole it passed. The card
+// times are assumptions for a card in SPI mode at 20 MHz; redo the choice
+// with figures measured on the device if they differ much.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "SectorCache.h"
+
+using namespace sdfat;
+
+// an 8 GB FAT32 card with 32 KB clusters
+#define SECTORS_PER_CLUSTER	64
+#define CLUSTER_BYTES		(SECTORS_PER_CLUSTER * 512)
+#define NUM_CLUSTERS		262144
+#define FAT_START			32
+#define FAT_SECTORS			(NUM_CLUSTERS / 128)
+#define DATA_START			(FAT_START + 2 * FAT_SECTORS)
+#define FOLDER_CLUSTER		3			// the upload folder, one cluster of entries
+#define FIRST_FREE			4
+#define EOC					0x0FFFFFFF
+
+// what is on the card already: the front is used, with holes left by
+// deleted files
+#define USED_PERCENT		40
+#define HOLE_PERCENT		3
+
+// the uploads, sizes spread evenly on a log scale
+#define CORPUS_FILES		300
+#define CORPUS_MIN_SIZE		200
+#define CORPUS_MAX_SIZE		(16UL * 1024 * 1024)
+#define ENTRIES_PER_FILE	3			// two long name entries and the short one
+
+// card time in microseconds
+#define T_COMMAND			50			// command and response
+#define T_ACCESS			300			// until a read's first data block
+#define T_TRANSFER			215			// 512 bytes and CRC at 20 MHz
+#define T_PROGRAM			700			// busy after a single block write
+#define T_PROGRAM_MULTI		150			// busy per block of a multi block write
+#define T_STOP				1000		// busy after the stop token
+#define T_FAT_ENTRY			1			// CPU per FAT entry looked at
+
+// ------------------------
+class CardModel : public FsBlockDeviceInterface	{
+// ------------------------
+public:
+	bool isBusy() override		{ return false; }
+	bool syncDevice() override	{ return true; }
+
+	bool readSector(uint32_t sector, uint8_t *dst) override	{
+		micros += T_COMMAND + T_ACCESS + T_TRANSFER;
+		return true;
+	}
+
+	bool readSectors(uint32_t sector, uint8_t *dst, size_t ns) override	{
+		micros += T_COMMAND + T_ACCESS + ns * T_TRANSFER + T_COMMAND;
+		return true;
+	}
+
+	bool writeSector(uint32_t sector, const uint8_t *src) override	{
+		micros += T_COMMAND + T_TRANSFER + T_PROGRAM;
+		return true;
+	}
+
+	bool writeSectors(uint32_t sector, const uint8_t *src, size_t ns) override	{
+		writeStart();
+		for(size_t i = 0; i < ns; i++)
+			writeData();
+		writeStop();
+		return true;
+	}
+
+	// the raw transfers of SdCard that handlePut() uses
+	void writeStart()			{ micros += T_COMMAND; }
+	void writeData()			{ micros += T_TRANSFER + T_PROGRAM_MULTI; }
+	void writeStop()			{ micros += T_STOP; }
+
+	uint64_t	micros = 0;
+};
+
+
+
+// ------------------------
+class VolumeModel	{
+// ------------------------
+public:
+	VolumeModel(FsBlockDevice *device, CardModel *card) : dev(device), card(card), fat(NUM_CLUSTERS + 2, 0)	{
+		// the same card for every run
+		uint32_t seed = 12345;
+		uint32_t usedEnd = FIRST_FREE + (uint64_t) NUM_CLUSTERS * USED_PERCENT / 100;
+		for(uint32_t c = 2; c < usedEnd; c++)	{
+			seed = seed * 1103515245 + 12345;
+			bool hole = c >= FIRST_FREE && (seed >> 16) % 100 < HOLE_PERCENT;
+			fat[c] = hole ? 0 : EOC;
+		}
+	}
+
+	// the file API: O_CREAT | O_TRUNC, 512 byte writes, close
+	void filePut(uint32_t size)	{
+		createEntry();
+		uint32_t first = 0, cluster = 0;
+		for(uint32_t pos = 0; pos < size; pos += 512)	{
+			if(pos % CLUSTER_BYTES == 0)	{
+				uint32_t next = allocCluster(cluster);
+				fatPut(next, EOC);
+				if(cluster)
+					fatPut(cluster, next);
+				else
+					first = next;
+				cluster = next;
+			}
+
+			// whole sectors go around SdFat's cache, the last piece into it
+			uint32_t sector = clusterSector(cluster) + (pos / 512) % SECTORS_PER_CLUSTER;
+			if(size - pos >= 512)	{
+				if(dataSlot.sector == sector)
+					dataSlot.sector = NONE;
+				dev->writeSector(sector, buf);
+			}
+			else	{
+				load(&dataSlot, sector, true);
+				dataSlot.dirty = true;
+			}
+		}
+		writeEntry();
+		sync();
+		readBack(first);
+	}
+
+	// handlePut()'s raw path: remove, createContiguous, raw writes, truncate
+	void rawPut(uint32_t size)	{
+		findEntry();
+		createEntry();
+		uint32_t count = (((size / 512 + 1) * 512) + CLUSTER_BYTES - 1) / CLUSTER_BYTES;
+		uint32_t first = allocContiguous(count);
+		writeEntry();
+		sync();
+
+		card->writeStart();
+		for(uint32_t pos = 0; pos < size; pos += 512)
+			card->writeData();
+		card->writeStop();
+
+		// the rounding up to whole sectors may have taken a cluster too many
+		uint32_t keep = (size + CLUSTER_BYTES - 1) / CLUSTER_BYTES;
+		if(keep < count)	{
+			fatPut(first + keep - 1, EOC);
+			for(uint32_t c = first + keep; c < first + count; c++)
+				freeCluster(c);
+		}
+		writeEntry();
+		sync();
+		readBack(first);
+	}
+
+	uint32_t	numExtents = 0;
+
+protected:
+	static const uint32_t NONE = 0xffffffff;
+
+	struct Slot	{
+		uint32_t	sector = NONE;
+		bool		dirty = false;
+	};
+
+	static uint32_t clusterSector(uint32_t cluster)	{ return DATA_START + (cluster - 2) * SECTORS_PER_CLUSTER; }
+
+	uint32_t fatGet(uint32_t cluster)	{
+		load(&fatSlot, FAT_START + cluster / 128, false);
+		card->micros += T_FAT_ENTRY;
+		return fat[cluster];
+	}
+
+	void fatPut(uint32_t cluster, uint32_t value)	{
+		load(&fatSlot, FAT_START + cluster / 128, false);
+		fat[cluster] = value;
+		fatSlot.dirty = true;
+	}
+
+	void freeCluster(uint32_t cluster)	{
+		fatPut(cluster, 0);
+		if(cluster <= searchStart)
+			searchStart = cluster - 1;
+	}
+
+	// FatPartition::allocateCluster()
+	uint32_t allocCluster(uint32_t current)	{
+		bool setStart = searchStart >= current;
+		uint32_t find = setStart ? searchStart : current;
+		for(;;)	{
+			find++;
+			if(find > NUM_CLUSTERS + 1)	{
+				find = searchStart;
+				setStart = true;
+				continue;
+			}
+			if(fatGet(find) == 0)
+				break;
+		}
+		if(setStart)
+			searchStart = find;
+		return find;
+	}
+
+	// FatPartition::allocContiguous()
+	uint32_t allocContiguous(uint32_t count)	{
+		bool setStart = true;
+		uint32_t bgn = searchStart + 1, end = bgn;
+		for(;;)	{
+			if(fatGet(end))	{
+				if(bgn != end)
+					setStart = false;
+				bgn = end + 1;
+			}
+			else if(end - bgn + 1 == count)
+				break;
+			end++;
+		}
+		if(setStart)
+			searchStart = end;
+
+		fatPut(end, EOC);
+		for(uint32_t c = end; c > bgn; c--)
+			fatPut(c - 1, c);
+		return bgn;
+	}
+
+	// the folder is searched to its end for the name, then the entry goes after the others
+	void findEntry()	{
+		uint32_t last = clusterSector(FOLDER_CLUSTER) + (2 + numFiles * ENTRIES_PER_FILE) / 16;
+		for(uint32_t s = clusterSector(FOLDER_CLUSTER); s <= last; s++)
+			load(&dataSlot, s, false);
+	}
+
+	void createEntry()	{
+		findEntry();
+		numFiles++;
+		writeEntry();
+	}
+
+	void writeEntry()	{
+		load(&dataSlot, clusterSector(FOLDER_CLUSTER) + (2 + numFiles * ENTRIES_PER_FILE - 1) / 16, false);
+		dataSlot.dirty = true;
+	}
+
+	// a GET with the file's map, one multi block read per run of clusters
+	void readBack(uint32_t first)	{
+		for(uint32_t c = first; c != EOC; c = fat[c])
+			if(c == first || fat[c - 1] != c)	{
+				card->micros += T_COMMAND + T_ACCESS + T_COMMAND;
+				numExtents++;
+			}
+	}
+
+	void load(Slot *slot, uint32_t sector, bool noRead)	{
+		if(slot->sector == sector)
+			return;
+		flush(slot);
+		if(!noRead)
+			dev->readSector(sector, buf);
+		slot->sector = sector;
+	}
+
+	void flush(Slot *slot)	{
+		if(!slot->dirty)
+			return;
+		dev->writeSector(slot->sector, buf);
+		// FAT sectors have a mirror in the second copy
+		if(slot == &fatSlot)
+			dev->writeSector(slot->sector + FAT_SECTORS, buf);
+		slot->dirty = false;
+	}
+
+	void sync()	{
+		flush(&dataSlot);
+		flush(&fatSlot);
+		dev->syncDevice();
+	}
+
+	FsBlockDevice *dev;
+	CardModel	*card;
+	std::vector<uint32_t> fat;
+	uint32_t	searchStart = 1;		// where SdFat starts after a mount
+	uint32_t	numFiles = 0;
+	Slot		dataSlot;
+	Slot		fatSlot;
+	uint8_t		buf[512] = {};
+};
+
+
+
+// ------------------------
+static std::vector<uint32_t> corpus()	{
+// ------------------------
+	// a fixed mix, log uniform from a few hundred bytes to 16 MB
+	std::vector<uint32_t> sizes;
+	uint32_t seed = 42;
+	for(int i = 0; i < CORPUS_FILES; i++)	{
+		seed = seed * 1103515245 + 12345;
+		double f = (double) ((seed >> 8) & 0xffff) / 0xffff;
+		double size = CORPUS_MIN_SIZE * pow((double) CORPUS_MAX_SIZE / CORPUS_MIN_SIZE, f);
+		sizes.push_back((uint32_t) size);
+	}
+	return sizes;
+}
+
+
+
+struct Result	{
+	uint64_t	micros;
+	uint32_t	numRaw;
+	uint32_t	numExtents;
+};
+
+// ------------------------
+static Result run(const std::vector<uint32_t>& sizes, uint64_t threshold, std::vector<uint64_t> *perFile)	{
+// ------------------------
+	CardModel card;
+	SectorCache cache;
+	cache.begin(&card);
+	VolumeModel vol(&cache, &card);
+
+	Result result = { 0, 0, 0 };
+	for(uint32_t size : sizes)	{
+		uint64_t before = card.micros;
+		if(size > threshold)	{
+			vol.rawPut(size);
+			result.numRaw++;
+		}
+		else
+			vol.filePut(size);
+		if(perFile)
+			perFile->push_back(card.micros - before);
+	}
+
+	result.micros = card.micros;
+	result.numExtents = vol.numExtents;
+	return result;
+}
+
+
+
+// ------------------------
+int main()	{
+// ------------------------
+	std::vector<uint32_t> sizes = corpus();
+	uint64_t totalBytes = 0;
+	for(uint32_t size : sizes)
+		totalBytes += size;
+	printf("%d uploads, %llu KB, card %d%% used with %d%% holes, %d sectors cached\n\n",
+		CORPUS_FILES, (unsigned long long) totalBytes / 1024, USED_PERCENT, HOLE_PERCENT, SECTOR_CACHE_SECTORS);
+
+	// the cost of each path by size, from a run with all files through it
+	std::vector<uint64_t> fileCost, rawCost;
+	run(sizes, UINT64_MAX, &fileCost);
+	run(sizes, 0, &rawCost);
+
+	printf("%-12s %6s %12s %12s\n", "size up to", "files", "file API ms", "raw ms");
+	for(uint64_t bucket = 1024; bucket <= CORPUS_MAX_SIZE; bucket *= 2)	{
+		uint64_t fileSum = 0, rawSum = 0;
+		int n = 0;
+		for(size_t i = 0; i < sizes.size(); i++)
+			if(sizes[i] <= bucket && sizes[i] > bucket / 2)	{
+				fileSum += fileCost[i];
+				rawSum += rawCost[i];
+				n++;
+			}
+		if(n)
+			printf("%9llu KB %6d %12.2f %12.2f\n", (unsigned long long) bucket / 1024, n, fileSum / 1000.0 / n, rawSum / 1000.0 / n);
+	}
+
+	// the whole corpus in order, raw above each threshold
+	printf("\n%-12s %6s %12s %8s\n", "threshold", "raw", "total ms", "extents");
+	uint64_t best = 0, bestMicros = UINT64_MAX;
+	for(uint64_t threshold = 512; threshold <= CORPUS_MAX_SIZE; threshold *= 2)	{
+		Result r = run(sizes, threshold, NULL);
+		printf("%9llu KB %6u %12.1f %8u\n", (unsigned long long) threshold / 1024, r.numRaw, r.micros / 1000.0, r.numExtents);
+		if(r.micros < bestMicros)	{
+			bestMicros = r.micros;
+			best = threshold;
+		}
+	}
+	printf("\nfastest with PUT_RAW_THRESHOLD %llu KB\n", (unsigned long long) best / 1024);
+	return 0;
+}
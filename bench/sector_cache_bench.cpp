@@ -0,0 +1,273 @@
+// Host harness for src/SectorCache.cpp. It replays the sector accesses of
+// a folder listing and of a batch of uploads on a RAM block device, once
+// straight and once through the cache, and reports the cache's hits and
+// misses and the sector I/O that reaches the device. Build and run:
+//
+//	g++ -O2 -std=c++14 -Ibench/host -Isrc bench/sector_cache_bench.cpp src/SectorCache.cpp -o sector_cache_bench && ./sector_cache_bench
+//
+// The volume is a model of what SdFat does on a FAT32 card with 32 KB
+// clusters: it keeps one data and one FAT sector, writes whole sectors of
+// file data around them and writes a FAT sector to both copies.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "SectorCache.h"
+
+using namespace sdfat;
+
+#define SECTORS_PER_CLUSTER	64
+#define FAT_START			32
+#define FAT_SECTORS			64			// per copy, 128 clusters each
+#define DATA_START			(FAT_START + 2 * FAT_SECTORS)
+#define NUM_CLUSTERS		512
+#define DISK_SECTORS		(DATA_START + NUM_CLUSTERS * SECTORS_PER_CLUSTER)
+
+#define ROOT_CLUSTER		2
+#define FOLDER_CLUSTER		3			// "/gcodes", one cluster of entries
+#define FIRST_FREE_CLUSTER	4
+
+#define FOLDER_FILES		40			// already in the folder
+#define ENTRIES_PER_FILE	3			// long name, two LFN entries and the short one
+#define LISTING_ROUNDS		3			// the folder is opened again, Explorer refreshes
+#define UPLOAD_FILES		20
+#define UPLOAD_SIZE			(48 * 1024)
+#define UPLOAD_CHUNK		2920		// what the FTP server writes at a time
+
+// ------------------------
+class RamDisk : public FsBlockDeviceInterface	{
+// ------------------------
+public:
+	RamDisk() : data(DISK_SECTORS * 512)	{}
+
+	bool isBusy() override		{ return false; }
+	bool readSector(uint32_t sector, uint8_t *dst) override		{ return readSectors(sector, dst, 1); }
+	bool writeSector(uint32_t sector, const uint8_t *src) override	{ return writeSectors(sector, src, 1); }
+	bool syncDevice() override	{ return true; }
+
+	bool readSectors(uint32_t sector, uint8_t *dst, size_t ns) override	{
+		if(sector + ns > DISK_SECTORS)
+			return false;
+		memcpy(dst, &data[sector * 512], ns * 512);
+		numRead += ns;
+		return true;
+	}
+
+	bool writeSectors(uint32_t sector, const uint8_t *src, size_t ns) override	{
+		if(sector + ns > DISK_SECTORS)
+			return false;
+		memcpy(&data[sector * 512], src, ns * 512);
+		numWritten += ns;
+		return true;
+	}
+
+	uint32_t	numRead = 0;
+	uint32_t	numWritten = 0;
+
+protected:
+	std::vector<uint8_t> data;
+};
+
+
+
+// ------------------------
+class VolumeModel	{
+// ------------------------
+public:
+	VolumeModel(FsBlockDevice *device) : dev(device)	{}
+
+	// a folder or FAT sector through SdFat's own caches
+	void readDir(uint32_t sector)				{ load(&dataSlot, sector, false); }
+	void writeDir(uint32_t sector)				{ load(&dataSlot, sector, false); dataSlot.dirty = true; }
+	void writeFat(uint32_t cluster)				{ load(&fatSlot, FAT_START + cluster / 128, false); fatSlot.dirty = true; }
+
+	// part of a sector of file data, a new one isn't read first
+	void writePartial(uint32_t sector, bool isNew)	{ load(&dataSlot, sector, isNew); dataSlot.dirty = true; }
+
+	// whole sectors of file data go around the cache
+	void writeWhole(uint32_t sector, size_t ns)	{
+		if(dataSlot.sector - sector < ns)
+			dataSlot.sector = NONE;
+		if(ns == 1)
+			dev->writeSector(sector, buf);
+		else
+			dev->writeSectors(sector, fileData, ns);
+	}
+
+	void sync()	{
+		flush(&dataSlot);
+		flush(&fatSlot);
+		dev->syncDevice();
+	}
+
+protected:
+	static const uint32_t NONE = 0xffffffff;
+
+	struct Slot	{
+		uint32_t	sector = NONE;
+		bool		dirty = false;
+	};
+
+	void load(Slot *slot, uint32_t sector, bool noRead)	{
+		if(slot->sector == sector)
+			return;
+		flush(slot);
+		if(!noRead)
+			dev->readSector(sector, buf);
+		slot->sector = sector;
+	}
+
+	void flush(Slot *slot)	{
+		if(!slot->dirty)
+			return;
+		dev->writeSector(slot->sector, buf);
+		// FAT sectors have a mirror in the second copy
+		if(slot == &fatSlot)
+			dev->writeSector(slot->sector + FAT_SECTORS, buf);
+		slot->dirty = false;
+	}
+
+	FsBlockDevice *dev;
+	Slot		dataSlot;
+	Slot		fatSlot;
+	uint8_t		buf[512] = {};
+	uint8_t		fileData[SECTORS_PER_CLUSTER * 512] = {};
+};
+
+
+
+// ------------------------
+static uint32_t clusterSector(uint32_t cluster)	{
+// ------------------------
+	return DATA_START + (cluster - ROOT_CLUSTER) * SECTORS_PER_CLUSTER;
+}
+
+
+
+// ------------------------
+static uint32_t entrySector(uint32_t file)	{
+// ------------------------
+	// "." and ".." come first, the short entry is the last of a file's
+	return clusterSector(FOLDER_CLUSTER) + (2 + file * ENTRIES_PER_FILE + ENTRIES_PER_FILE - 1) / 16;
+}
+
+
+
+// ------------------------
+static void listing(VolumeModel *vol)	{
+// ------------------------
+	for(int round = 0; round < LISTING_ROUNDS; round++)	{
+		// PROPFIND Depth 1: "/gcodes" is found in the root, then its entries are read
+		vol->readDir(clusterSector(ROOT_CLUSTER));
+		for(uint32_t i = 0; i < FOLDER_FILES; i++)
+			vol->readDir(entrySector(i));
+
+		// then every file on its own, opened through the name index
+		for(uint32_t i = 0; i < FOLDER_FILES; i++)	{
+			vol->readDir(clusterSector(ROOT_CLUSTER));
+			vol->readDir(entrySector(i));
+		}
+	}
+}
+
+
+
+// ------------------------
+static void uploads(VolumeModel *vol)	{
+// ------------------------
+	uint32_t cluster = FIRST_FREE_CLUSTER;
+
+	for(uint32_t f = 0; f < UPLOAD_FILES; f++)	{
+		uint32_t entry = entrySector(FOLDER_FILES + f);
+
+		// the folder is found and searched for free entries, the new ones written
+		vol->readDir(clusterSector(ROOT_CLUSTER));
+		for(uint32_t s = clusterSector(FOLDER_CLUSTER); s <= entry; s++)
+			vol->readDir(s);
+		vol->writeDir(entry);
+
+		// the data in chunks that don't fit sectors, each cluster taken from the FAT
+		uint32_t first = cluster;
+		for(uint32_t pos = 0; pos < UPLOAD_SIZE; )	{
+			uint32_t len = UPLOAD_CHUNK < UPLOAD_SIZE - pos ? UPLOAD_CHUNK : UPLOAD_SIZE - pos;
+			uint32_t end = pos + len;
+			while(pos < end)	{
+				uint32_t offset = pos % 512;
+				uint32_t sector = clusterSector(first + pos / (SECTORS_PER_CLUSTER * 512)) + (pos / 512) % SECTORS_PER_CLUSTER;
+				if(pos % (SECTORS_PER_CLUSTER * 512) == 0)	{
+					vol->writeFat(cluster);
+					cluster++;
+				}
+
+				if(offset == 0 && end - pos >= 512)	{
+					size_t ns = (end - pos) / 512;
+					size_t left = SECTORS_PER_CLUSTER - (pos / 512) % SECTORS_PER_CLUSTER;
+					ns = ns < left ? ns : left;
+					vol->writeWhole(sector, ns);
+					pos += ns * 512;
+				}
+				else	{
+					uint32_t n = 512 - offset < end - pos ? 512 - offset : end - pos;
+					vol->writePartial(sector, offset == 0);
+					pos += n;
+				}
+			}
+		}
+
+		// close updates the entry and syncs
+		vol->writeDir(entry);
+		vol->sync();
+
+		// the client sets the times and looks at the result
+		vol->readDir(clusterSector(ROOT_CLUSTER));
+		vol->writeDir(entry);
+		vol->sync();
+		vol->readDir(clusterSector(ROOT_CLUSTER));
+		vol->readDir(entry);
+	}
+}
+
+
+
+// ------------------------
+static std::string percent(uint32_t before, uint32_t after)	{
+// ------------------------
+	char text[16];
+	if(before)
+		snprintf(text, sizeof(text), "%7.0f%%", 100.0 * ((double) before - after) / before);
+	else
+		snprintf(text, sizeof(text), "%8s", "-");
+	return text;
+}
+
+
+
+// ------------------------
+static void run(const char *name, void (*pattern)(VolumeModel *))	{
+// ------------------------
+	RamDisk plain;
+	VolumeModel direct(&plain);
+	pattern(&direct);
+
+	RamDisk cached;
+	SectorCache cache;
+	cache.begin(&cached);
+	VolumeModel through(&cache);
+	pattern(&through);
+
+	printf("%-10s %-8s %8u %8u %8s %8s\n", name, "direct", plain.numRead, plain.numWritten, "-", "-");
+	printf("%-10s %-8s %8u %8u %8u %8u\n", "", "cached", cached.numRead, cached.numWritten, cache.hits(), cache.misses());
+	printf("%-10s %-8s %s %s\n", "", "saved", percent(plain.numRead, cached.numRead).c_str(), percent(plain.numWritten, cached.numWritten).c_str());
+}
+
+
+
+// ------------------------
+int main()	{
+// ------------------------
+	printf("%d sectors cached, sector I/O on the device\n", SECTOR_CACHE_SECTORS);
+	printf("%-10s %-8s %8s %8s %8s %8s\n", "pattern", "", "reads", "writes", "hits", "misses");
+	run("listing", listing);
+	run("upload", uploads);
+	return 0;
+}
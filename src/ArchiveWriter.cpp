@@ -0,0 +1,427 @@
+#include "ArchiveWriter.h"
+#include "GzipStream.h"
+#include "CardCache.h"
+
+using namespace sdfat;
+
+// ------------------------
+static void put16(uint8_t *p, uint16_t value)	{
+// ------------------------
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+
+
+// ------------------------
+static void put32(uint8_t *p, uint32_t value)	{
+// ------------------------
+	put16(p, value);
+	put16(p + 2, value >> 16);
+}
+
+
+
+// ------------------------
+static uint32_t unixTime(uint16_t date, uint16_t time)	{
+// ------------------------
+	if(FS_MONTH(date) == 0)
+		return 0;
+
+	// days since 1970 with years starting in March, leap days come last
+	int y = FS_YEAR(date) - (FS_MONTH(date) <= 2);
+	int m = (FS_MONTH(date) + 9) % 12;
+	uint32_t days = y * 365 + y / 4 - y / 100 + y / 400 + (153 * m + 2) / 5 + FS_DAY(date) - 1 - 719468;
+	return days * 86400 + FS_HOUR(time) * 3600 + FS_MINUTE(time) * 60 + FS_SECOND(time);
+}
+
+
+
+// ------------------------
+ArchiveWriter::~ArchiveWriter()	{
+// ------------------------
+	end();
+}
+
+
+
+// ------------------------
+bool ArchiveWriter::begin(const String& root, ArchiveFormat archiveFormat)	{
+// ------------------------
+	format = archiveFormat;
+	state = ARC_NEXT;
+	headLen = headPos = 0;
+	offset = 0;
+	entries = 0;
+	failed = 0;
+	numUnlisted = 0;
+	errors = String();
+	errorsSent = false;
+	numTrailer = 0;
+
+	if(!walker.begin(root))
+		return false;
+
+	// members are stored below the name of the directory, if it has one
+	prefix = root;
+	while(prefix.endsWith("/"))
+		prefix.remove(prefix.length() - 1);
+	prefix = prefix.substring(prefix.lastIndexOf('/') + 1);
+
+	if(format == ARCHIVE_ZIP)	{
+		// one file per archive being sent, it is left out of the walk
+		spoolPath = "/~archive" + String((uintptr_t) this, HEX) + ".tmp";
+		if(!spool.open(spoolPath.c_str(), O_RDWR | O_CREAT | O_TRUNC))	{
+			walker.end();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+
+// ------------------------
+size_t ArchiveWriter::read(uint8_t *dst, size_t maxLen)	{
+// ------------------------
+	size_t n = 0;
+	while(n < maxLen)	{
+		size_t len;
+
+		if(headPos < headLen)	{
+			len = min(maxLen - n, (size_t) (headLen - headPos));
+			memcpy(dst + n, head + headPos, len);
+			headPos += len;
+		}
+		else if(state == ARC_DATA)	{
+			len = min(maxLen - n, (size_t) dataRemaining);
+			int numRead;
+			if(isErrors)	{
+				memcpy(dst + n, errors.c_str() + size - dataRemaining, len);
+				numRead = len;
+			}
+			else
+				numRead = file.read(dst + n, len);
+			if(numRead <= 0)	{
+				// the size is in the header already, the rest is sent as zeros
+				memset(dst + n, 0, len);
+				readFailed = true;
+			}
+			else
+				len = numRead;
+
+			crc = GzipStream::updateCrc(crc, dst + n, len);
+			dataRemaining -= len;
+			if(dataRemaining == 0)
+				state = ARC_DATA_END;
+		}
+		else if(produce())
+			continue;
+		else
+			break;
+
+		n += len;
+		offset += len;
+	}
+
+	return n;
+}
+
+
+
+// ------------------------
+bool ArchiveWriter::produce()	{
+// ------------------------
+	// fills head with what comes next, false at the end of the archive
+	headPos = 0;
+	headLen = 0;
+
+	switch(state)	{
+	case ARC_NEXT:
+		isErrors = false;
+		if(nextEntry())
+			state = (format == ARCHIVE_TAR && name.length() > 100) ? ARC_LONGNAME : ARC_HEADER;
+		else if(errors.length() && !errorsSent)	{
+			// what was left out, as the last member
+			if(numUnlisted)
+				errors += "and " + String(numUnlisted) + " more\n";
+			name = prefix.length() ? prefix + "/" ARCHIVE_ERRORS_NAME : ARCHIVE_ERRORS_NAME;
+			isDir = false;
+			size = errors.length();
+			dosDate = dosTime = 0;
+			attributes = 0;
+			isErrors = true;
+			errorsSent = true;
+			state = ARC_HEADER;
+		}
+		else if(format == ARCHIVE_TAR)
+			state = ARC_TRAILER;
+		else	{
+			state = ARC_CENTRAL;
+			spool.seekSet(0);
+		}
+		return true;
+
+	case ARC_LONGNAME:
+		// GNU tar: a pseudo member holding the name that doesn't fit
+		tarHeader("././@LongLink", name.length() + 1, 'L');
+		namePos = 0;
+		state = ARC_LONGNAME_DATA;
+		return true;
+
+	case ARC_LONGNAME_DATA:
+		// the name with its NUL, padded to whole blocks
+		memset(head, 0, 512);
+		headLen = 512;
+		memcpy(head, name.c_str() + namePos, min(name.length() - namePos, (unsigned int) 512));
+		namePos += 512;
+		if(namePos > name.length())
+			state = ARC_HEADER;
+		return true;
+
+	case ARC_HEADER:
+		if(format == ARCHIVE_TAR)
+			tarHeader(name.c_str(), size, isDir ? '5' : '0');
+		else if(isErrors || zipFits())
+			zipLocalHeader();
+		else	{
+			file.close();
+			addError(name, "zip would exceed 4 GiB or 65535 members");
+			state = ARC_NEXT;
+			return true;
+		}
+		crc = 0xffffffff;
+		dataRemaining = size;
+		readFailed = false;
+		entries++;
+		state = size ? ARC_DATA : ARC_DATA_END;
+		return true;
+
+	case ARC_DATA_END:
+		file.close();
+		if(readFailed)
+			addError(name, "read error, zero filled");
+
+		crc = ~crc;
+		if(format == ARCHIVE_TAR)	{
+			// data is padded to whole blocks
+			memset(head, 0, 512);
+			headLen = (512 - size % 512) % 512;
+		}
+		else	{
+			if(!isDir)	{
+				// data descriptor, the sizes weren't in the local header
+				put32(head, 0x08074b50);
+				put32(head + 4, crc);
+				put32(head + 8, size);
+				put32(head + 12, size);
+				headLen = 16;
+			}
+			zipCentralRecord();
+		}
+		state = ARC_NEXT;
+		return true;
+
+	case ARC_CENTRAL:	{
+		// the records collected on the card, then the end record
+		int numRead = spool.read(head, 512);
+		if(numRead > 0)
+			headLen = numRead;
+		else	{
+			zipEndRecord();
+			state = ARC_DONE;
+		}
+		return true;
+	}
+
+	case ARC_TRAILER:
+		// two zero blocks end a tar archive
+		memset(head, 0, 512);
+		headLen = 512;
+		if(++numTrailer == 2)
+			state = ARC_DONE;
+		return true;
+
+	case ARC_DONE:
+	default:
+		return false;
+	}
+}
+
+
+
+// ------------------------
+bool ArchiveWriter::nextEntry()	{
+// ------------------------
+	while(walker.next())	{
+		WalkEntry entry = walker.entry();
+		if(entry == WALK_DIR_LEAVE || walker.path() == spoolPath)
+			continue;
+
+		if(entry == WALK_DIR_TOO_DEEP)	{
+			addError(walker.path(), "nested too deep");
+			continue;
+		}
+
+		isDir = entry == WALK_DIR_ENTER;
+		name = prefix.length() ? prefix + walker.relativePath() : walker.relativePath().substring(1);
+		if(isDir)
+			name += "/";
+
+		if(name.length() > ARCHIVE_MAX_NAME)	{
+			addError(walker.path(), "name too long");
+			continue;
+		}
+		if(!isDir && !walker.open(&file))	{
+			addError(walker.path(), "can't be opened");
+			continue;
+		}
+
+		const DirFat_t& dir = walker.dirEntry();
+		dosDate = getLe16(dir.modifyDate);
+		dosTime = getLe16(dir.modifyTime);
+		attributes = dir.attributes;
+		size = isDir ? 0 : walker.size();
+		return true;
+	}
+
+	return false;
+}
+
+
+
+// ------------------------
+void ArchiveWriter::addError(const String& path, const char *reason)	{
+// ------------------------
+	failed++;
+
+	// room is left for the line counting the rest
+	String line = path + ": " + reason + "\n";
+	if(errorsSent || errors.length() + line.length() > ARCHIVE_MAX_ERRORS - 32)
+		numUnlisted++;
+	else
+		errors += line;
+}
+
+
+
+// ------------------------
+void ArchiveWriter::tarHeader(const char *entryName, uint32_t entrySize, char type)	{
+// ------------------------
+	memset(head, 0, 512);
+	headLen = 512;
+
+	// numbers are octal text, the name may fill its field without a NUL
+	strncpy((char *) head, entryName, 100);
+	sprintf((char *) head + 100, "%07o", type == '5' ? 0755 : 0644);
+	sprintf((char *) head + 108, "%07o", 0);
+	sprintf((char *) head + 116, "%07o", 0);
+	sprintf((char *) head + 124, "%011lo", (unsigned long) entrySize);
+	sprintf((char *) head + 136, "%011lo", (unsigned long) (type == 'L' ? 0 : unixTime(dosDate, dosTime)));
+	head[156] = type;
+	memcpy(head + 257, "ustar  ", 8);
+
+	// the checksum is taken with its own field as spaces
+	memset(head + 148, ' ', 8);
+	uint32_t sum = 0;
+	for(int i = 0; i < 512; i++)
+		sum += head[i];
+	sprintf((char *) head + 148, "%06lo", (unsigned long) sum);
+	head[155] = ' ';
+}
+
+
+
+// ------------------------
+void ArchiveWriter::zipLocalHeader()	{
+// ------------------------
+	// sizes and CRC follow the data in a descriptor (flag bit 3)
+	localOffset = offset;
+	put32(head, 0x04034b50);
+	put16(head + 4, 20);
+	put16(head + 6, isDir ? 0 : 0x0008);
+	put16(head + 8, 0);
+	put16(head + 10, dosTime);
+	put16(head + 12, dosDate);
+	put32(head + 14, 0);
+	put32(head + 18, 0);
+	put32(head + 22, 0);
+	put16(head + 26, name.length());
+	put16(head + 28, 0);
+	memcpy(head + 30, name.c_str(), name.length());
+	headLen = 30 + name.length();
+}
+
+
+
+// ------------------------
+bool ArchiveWriter::zipFits()	{
+// ------------------------
+	// the member with its descriptor and central record, the central
+	// directory so far, the list of errors and the end record all have
+	// to stay addressable with 32 bits; one entry is kept for the list
+	uint64_t total = (uint64_t) offset + 30 + name.length() + size + 16;
+	total += spool.fileSize() + 46 + name.length();
+	total += 30 + ARCHIVE_MAX_NAME + ARCHIVE_MAX_ERRORS + 16 + 46 + ARCHIVE_MAX_NAME + 22;
+	return entries < 0xfffe && total <= 0xffffffff;
+}
+
+
+
+// ------------------------
+void ArchiveWriter::zipCentralRecord()	{
+// ------------------------
+	uint8_t rec[46];
+	put32(rec, 0x02014b50);
+	put16(rec + 4, 20);
+	put16(rec + 6, 20);
+	put16(rec + 8, isDir ? 0 : 0x0008);
+	put16(rec + 10, 0);
+	put16(rec + 12, dosTime);
+	put16(rec + 14, dosDate);
+	put32(rec + 16, isDir ? 0 : crc);
+	put32(rec + 20, size);
+	put32(rec + 24, size);
+	put16(rec + 28, name.length());
+	put16(rec + 30, 0);
+	put16(rec + 32, 0);
+	put16(rec + 34, 0);
+	put16(rec + 36, 0);
+	// MS-DOS attributes, the directory bit among them
+	put32(rec + 38, attributes & FS_ATTRIB_COPY);
+	put32(rec + 42, localOffset);
+
+	if(spool.write(rec, 46) != 46 || spool.write(name.c_str(), name.length()) != name.length())
+		addError(name, "missing from the zip directory");
+}
+
+
+
+// ------------------------
+void ArchiveWriter::zipEndRecord()	{
+// ------------------------
+	uint32_t dirSize = spool.fileSize();
+	put32(head, 0x06054b50);
+	put16(head + 4, 0);
+	put16(head + 6, 0);
+	put16(head + 8, entries);
+	put16(head + 10, entries);
+	put32(head + 12, dirSize);
+	put32(head + 16, offset - dirSize);
+	put16(head + 20, 0);
+	headLen = 22;
+}
+
+
+
+// ------------------------
+void ArchiveWriter::end()	{
+// ------------------------
+	walker.end();
+	file.close();
+	if(spool.isOpen())	{
+		spool.remove();
+		cardChanged(spoolPath);
+	}
+}
@@ -0,0 +1,80 @@
+#ifndef ARCHIVEWRITER_H
+#define ARCHIVEWRITER_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "TreeWalker.h"
+
+// longer member names are left out, this keeps a zip header in one block
+#define ARCHIVE_MAX_NAME	480
+// members that are left out are listed in a last member of this name
+#define ARCHIVE_ERRORS_NAME	"ARCHIVE-ERRORS.txt"
+#define ARCHIVE_MAX_ERRORS	1024
+
+enum ArchiveFormat { ARCHIVE_TAR, ARCHIVE_ZIP };
+
+// Produces a tar or stored (uncompressed) zip archive of a directory
+// subtree while it is read, so memory use does not depend on the size of
+// the tree. Headers are generated per member and CRCs computed as the data
+// passes. Zip needs its central directory at the end, the records for it
+// are collected in a temporary file in the card's root and appended.
+// Zip is written without ZIP64, members that would take it past 4 GiB or
+// 65535 entries are left out. Whatever couldn't be archived is named in
+// a text member at the end, so a download never silently misses files.
+class ArchiveWriter	{
+public:
+	~ArchiveWriter();
+	bool begin(const String& root, ArchiveFormat archiveFormat);
+	size_t read(uint8_t *dst, size_t maxLen);
+	void end();
+
+	uint16_t numEntries()		{ return entries; }
+	uint16_t numFailed()		{ return failed; }
+
+protected:
+	enum State { ARC_NEXT, ARC_LONGNAME, ARC_LONGNAME_DATA, ARC_HEADER, ARC_DATA, ARC_DATA_END, ARC_CENTRAL, ARC_TRAILER, ARC_DONE };
+
+	bool produce();
+	bool nextEntry();
+	void tarHeader(const char *entryName, uint32_t size, char type);
+	void zipLocalHeader();
+	void zipCentralRecord();
+	void zipEndRecord();
+	bool zipFits();
+	void addError(const String& path, const char *reason);
+
+	ArchiveFormat format;
+	State		state;
+	TreeWalker	walker;
+	String		prefix;			// name of the archived directory
+	String		spoolPath;
+	sdfat::FatFile spool;		// zip central directory
+	sdfat::FatFile file;
+	uint8_t		head[512];		// header or trailer being sent
+	uint16_t	headLen;
+	uint16_t	headPos;
+
+	// current member
+	String		name;
+	unsigned int namePos;
+	bool		isDir;
+	uint32_t	size;
+	uint16_t	dosDate;
+	uint16_t	dosTime;
+	uint8_t		attributes;
+	uint32_t	dataRemaining;
+	uint32_t	crc;
+	uint32_t	localOffset;
+	bool		readFailed;
+	bool		isErrors;		// the member is the list of errors
+
+	uint32_t	offset;			// bytes of the archive produced so far
+	uint16_t	entries;
+	uint16_t	failed;
+	uint16_t	numUnlisted;
+	String		errors;
+	bool		errorsSent;
+	uint8_t		numTrailer;
+};
+
+#endif // ARCHIVEWRITER_H
@@ -28,6 +28,9 @@
 
 // SD card
 #define SD_CS 5
+// chip select of the printer, tells whether it used the card while we didn't
+#define SD_CS_SENSE 4
+// the fastest clock allowed, each card is tested at mount for what it can do
 sdfat::SdSpiConfig sdconfig(SD_CS, DEDICATED_SPI, SD_SCK_MHZ(40));
 
 // Webserver Infopage, Firmwareupdate
@@ -115,6 +118,11 @@ void setup()
 	ftpSrv.begin("anonymous", "", &sdconfig); //username, password for ftp.  set ports in ESP8266FtpServer.h  (default 21, 50009 for PASV)
 	Serial.println("FTP server started");
 
+	// the card is only held while WebDAV or FTP use it
+	cardVolume.begin(SD_CS_SENSE);
+	// uploads arriving while the printer has the card wait in flash
+	uploadSpool.begin();
+
 	// Setup FLASH button and LED
 	pinMode(BOOT_BUTTON_PIN, INPUT_PULLUP);
 	pinMode(LED_PIN, OUTPUT);
@@ -125,22 +133,54 @@ void setup()
 
 void loop()
 {
-	// WebDAV
-	if (dav.isClientWaiting())
+	// a client could change the file being defragmented or committed, that
+	// work gives way before a request is handled; the printer wants the card back
+	if (!dav.isIdle() || ftpSrv.isTransferring())
 	{
-		Serial.println("Client connected");
-		if (initFailed)
-			return dav.rejectClient(statusMessage);
+		defragmenter.cancel();
+		uploadSpool.cancel();
+	}
+	if (cardVolume.printerBusy())
+		defragmenter.stop();
 
-		// call handle if server was initialized properly
+	// WebDAV
+	if (initFailed)
+		dav.rejectClient(statusMessage);
+	else
+	{
+		if (dav.isClientWaiting())
+		{
+			Serial.println("Client connected");
+			dav.initSD(sdconfig);
+		}
 
-		dav.initSD(sdconfig);
+		// open connections make progress on every pass
 		dav.handleClient();
 	}
 
 	// FTP
 	ftpSrv.handleFTP(); //make sure in loop you call handleFTP()!!
 
+	// spooled uploads take the card back as soon as the printer leaves it
+	if (!initFailed && !cardVolume.isMounted() && uploadSpool.wantsCard())
+		dav.initSD(sdconfig);
+
+	// spooled uploads are committed, gzip sidecars are built, files are
+	// defragmented and free space is counted while nobody else uses the card
+	if (!initFailed && cardVolume.isMounted() && dav.isIdle() && !ftpSrv.isTransferring())
+	{
+		uploadSpool.step();
+		sidecarBuilder.step();
+		if (!sidecarBuilder.isRunning())
+			defragmenter.step();
+		// a file half written would be counted twice
+		if (!sidecarBuilder.isRunning() && !defragmenter.isRunning() && !uploadSpool.isCommitting())
+			freeSpace.step();
+	}
+
+	// hand the card back to the printer once all of that is done
+	cardVolume.step(!dav.isIdle() || ftpSrv.isTransferring() || uploadSpool.isCommitting() || sidecarBuilder.isRunning() || defragmenter.isRunning() || freeSpace.isScanning());
+
 	// Web OTA update
 	webota.handle();
 
@@ -0,0 +1,19 @@
+#include "CardCache.h"
+
+// ------------------------
+void cardChanged(const String& path)	{
+// ------------------------
+	propCache.invalidate(path);
+	nameIndex.invalidate(path);
+	fileCache.invalidate(path);
+}
+
+
+
+// ------------------------
+void cardReplaced()	{
+// ------------------------
+	propCache.clear();
+	nameIndex.clear();
+	fileCache.clear();
+}
@@ -0,0 +1,13 @@
+#ifndef CARDCACHE_H
+#define CARDCACHE_H
+
+#include "PropCache.h"
+#include "NameIndex.h"
+#include "FileCache.h"
+
+// Everything kept in RAM about the card's contents. Whatever changes a path
+// on the card reports it here, a newly mounted card drops it all.
+void cardChanged(const String& path);
+void cardReplaced();
+
+#endif // CARDCACHE_H
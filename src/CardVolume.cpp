@@ -0,0 +1,354 @@
+#include <SPI.h>
+#include <EEPROM.h>
+#include "CardVolume.h"
+#include "CardCache.h"
+#include "FreeSpace.h"
+#include "Defragmenter.h"
+#include "GzipStream.h"
+
+using namespace sdfat;
+
+CardVolume cardVolume;
+
+// ESP8266 clocks are 80 MHz divided, fastest first
+static const uint32_t clockRates[] = { 40000000, 26666667, 20000000, 16000000, 13333333, 10000000, 8000000, CARD_SAFE_CLOCK };
+
+// card clocks in the emulated EEPROM, most recent card first
+struct ClockTable	{
+	uint32_t	magic;
+	uint32_t	key[CARD_CLOCK_CARDS];
+	uint32_t	rate[CARD_CLOCK_CARDS];
+};
+#define CLOCK_TABLE_MAGIC	0x53434b32
+volatile uint32_t CardVolume::senseCount = 0;
+volatile uint32_t CardVolume::lastSense;
+
+// ------------------------
+void IRAM_ATTR CardVolume::senseInterrupt()	{
+// ------------------------
+	senseCount++;
+	lastSense = millis();
+}
+
+
+
+// ------------------------
+void CardVolume::begin(int8_t sensePin)	{
+// ------------------------
+	// without the sense line every mount after a release starts from scratch
+	if(sensePin < 0)
+		return;
+
+	pinMode(sensePin, INPUT);
+	attachInterrupt(digitalPinToInterrupt(sensePin), senseInterrupt, FALLING);
+	sensing = true;
+}
+
+
+
+// ------------------------
+bool CardVolume::mount(const SdSpiConfig& config)	{
+// ------------------------
+	lastUse = millis();
+	if(mounted)
+		return true;
+	// taking the bus now would garble what the printer reads
+	if(printerBusy())
+		return false;
+
+	csPin = config.csPin;
+	spiOptions = config.options;
+	if(!released || !resume())	{
+		// listings from before may not match what is on the card now
+		cardReplaced();
+		if(!beginTuned(config) || !attach(true))	{
+			released = false;
+			return false;
+		}
+
+		freeSpace.mount(&sd);
+		defragmenter.mount();
+		remember();
+	}
+
+	mounted = true;
+	released = false;
+	return true;
+}
+
+
+
+// ------------------------
+bool CardVolume::beginTuned(const SdSpiConfig& config)	{
+// ------------------------
+	// what the test sectors hold, read slowly enough to be right
+	uint32_t reference;
+	if(!sd.begin(SdSpiConfig(csPin, spiOptions, CARD_SAFE_CLOCK)) || !readSectorsCrc(&reference))
+		return false;
+
+	// a card seen before only has its clock verified
+	uint32_t key = cidKey();
+	uint32_t rate = loadClock(key);
+	if(rate && rate <= config.maxSck)	{
+		if(sd.cardBegin(SdSpiConfig(csPin, spiOptions, rate)) && readTest(reference))	{
+			clockRate = rate;
+			return true;
+		}
+
+		// the card changed or the clock doesn't work anymore, test all again
+		if(!sd.cardBegin(SdSpiConfig(csPin, spiOptions, CARD_SAFE_CLOCK)))
+			return false;
+	}
+
+	// the scratch file is written at every clock, nothing else is
+	FatFile scratch;
+	uint32_t bgnBlock, endBlock;
+	sd.remove(CARD_SCRATCH_FILE);
+	bool canWrite = scratch.createContiguous(CARD_SCRATCH_FILE, CARD_TEST_SECTORS * 512) && scratch.contiguousRange(&bgnBlock, &endBlock);
+	scratch.close();
+
+	// one clock below the fastest that passes, for some margin
+	const size_t numRates = sizeof(clockRates) / sizeof(clockRates[0]);
+	rate = CARD_SAFE_CLOCK;
+	for(size_t i = 0; i < numRates; i++)	{
+		if(clockRates[i] > config.maxSck)
+			continue;
+		if(sd.cardBegin(SdSpiConfig(csPin, spiOptions, clockRates[i])) && readTest(reference) && (!canWrite || writeTest(bgnBlock)))	{
+			rate = clockRates[min(i + 1, numRates - 1)];
+			break;
+		}
+	}
+
+	// the volume is read again at the clock it's used with, the speed
+	// shown is measured at it too
+	if(!sd.begin(SdSpiConfig(csPin, spiOptions, rate)))
+		return false;
+	readTest(reference);
+	sd.remove(CARD_SCRATCH_FILE);
+
+	clockRate = rate;
+	saveClock(key, rate);
+	Serial.print("SD card SPI clock "); Serial.print(rate / 1000); Serial.print(" kHz, reads "); Serial.print(readKBps); Serial.println(" KB/s");
+	return true;
+}
+
+
+
+// ------------------------
+bool CardVolume::readTest(uint32_t reference)	{
+// ------------------------
+	uint32_t tStart = micros();
+	for(int pass = 0; pass < CARD_TEST_PASSES; pass++)	{
+		uint32_t crc;
+		if(!readSectorsCrc(&crc) || crc != reference)
+			return false;
+	}
+
+	uint32_t t = max((uint32_t) (micros() - tStart), (uint32_t) 1);
+	readKBps = (uint64_t) CARD_TEST_PASSES * CARD_TEST_SECTORS * 512 * 1000000 / 1024 / t;
+	return true;
+}
+
+
+
+// ------------------------
+bool CardVolume::readSectorsCrc(uint32_t *crc)	{
+// ------------------------
+	// the start of the FAT, it doesn't change while the card is mounted
+	uint8_t buf[512];
+	SdCard *card = sd.card();
+	if(!card->readStart(sd.fatStartSector()))
+		return false;
+
+	*crc = ~0UL;
+	for(int i = 0; i < CARD_TEST_SECTORS; i++)	{
+		if(!card->readData(buf))	{
+			card->readStop();
+			return false;
+		}
+		*crc = GzipStream::updateCrc(*crc, buf, sizeof(buf));
+	}
+	return card->readStop();
+}
+
+
+
+// ------------------------
+bool CardVolume::writeTest(uint32_t scratch)	{
+// ------------------------
+	// a pattern of its own per clock, what an earlier clock wrote doesn't count
+	uint8_t buf[512];
+	uint8_t seed = micros();
+	SdCard *card = sd.card();
+	for(int i = 0; i < CARD_TEST_SECTORS; i++)	{
+		for(int j = 0; j < 512; j++)
+			buf[j] = seed + i * 31 + j * 7;
+		if(!card->writeSector(scratch + i, buf))
+			return false;
+	}
+
+	for(int i = 0; i < CARD_TEST_SECTORS; i++)	{
+		if(!card->readSector(scratch + i, buf))
+			return false;
+		for(int j = 0; j < 512; j++)
+			if(buf[j] != (uint8_t) (seed + i * 31 + j * 7))
+				return false;
+	}
+	return true;
+}
+
+
+
+// ------------------------
+uint32_t CardVolume::cidKey()	{
+// ------------------------
+	cid_t newCid;
+	if(!sd.card()->readCID(&newCid))
+		return 0;
+	return GzipStream::updateCrc(~0UL, (const uint8_t *) &newCid, sizeof(newCid));
+}
+
+
+
+// ------------------------
+uint32_t CardVolume::loadClock(uint32_t key)	{
+// ------------------------
+	ClockTable table;
+	EEPROM.begin(sizeof(table));
+	EEPROM.get(0, table);
+	EEPROM.end();
+
+	if(!key || table.magic != CLOCK_TABLE_MAGIC)
+		return 0;
+	for(int i = 0; i < CARD_CLOCK_CARDS; i++)
+		if(table.key[i] == key)
+			return table.rate[i];
+	return 0;
+}
+
+
+
+// ------------------------
+void CardVolume::saveClock(uint32_t key, uint32_t rate)	{
+// ------------------------
+	if(!key)
+		return;
+
+	ClockTable table;
+	EEPROM.begin(sizeof(table));
+	EEPROM.get(0, table);
+	if(table.magic != CLOCK_TABLE_MAGIC)	{
+		memset(&table, 0, sizeof(table));
+		table.magic = CLOCK_TABLE_MAGIC;
+	}
+
+	// the card moves to the front, the one not seen the longest drops out
+	int i = 0;
+	while(i < CARD_CLOCK_CARDS - 1 && table.key[i] != key)
+		i++;
+	for(; i > 0; i--)	{
+		table.key[i] = table.key[i - 1];
+		table.rate[i] = table.rate[i - 1];
+	}
+	table.key[0] = key;
+	table.rate[0] = rate;
+
+	EEPROM.put(0, table);
+	EEPROM.end();
+}
+
+
+
+// ------------------------
+bool CardVolume::resume()	{
+// ------------------------
+	// the printer may have written to the card or left it in another state
+	if(!sensing || senseCount != releaseCount)
+		return false;
+
+	SPI.begin();
+	pinMode(csPin, OUTPUT);
+	digitalWrite(csPin, HIGH);
+
+	// the card still knows us, a swapped card or a rewritten boot sector doesn't
+	cid_t newCid;
+	if(!sd.card()->readCID(&newCid) || memcmp(&newCid, &cid, sizeof(cid)))
+		return false;
+
+	// the boot sector is read from the card again, not from the cache
+	sectors.invalidate(0, fatStart);
+	return attach(false) && sameGeometry();
+}
+
+
+
+// ------------------------
+bool CardVolume::attach(bool clear)	{
+// ------------------------
+	// the cached sectors are still valid if the printer didn't touch the card
+	if(clear)
+		sectors.begin(sd.card());
+	return sd.FatVolume::begin(&sectors);
+}
+
+
+
+// ------------------------
+void CardVolume::remember()	{
+// ------------------------
+	if(!sd.card()->readCID(&cid))
+		memset(&cid, 0, sizeof(cid));
+	fatStart = sd.fatStartSector();
+	dataStart = sd.dataStartSector();
+	clusters = sd.clusterCount();
+}
+
+
+
+// ------------------------
+bool CardVolume::sameGeometry()	{
+// ------------------------
+	return sd.fatStartSector() == fatStart && sd.dataStartSector() == dataStart && sd.clusterCount() == clusters;
+}
+
+
+
+// ------------------------
+bool CardVolume::printerBusy()	{
+// ------------------------
+	return sensing && senseCount && millis() - lastSense < CARD_PRINTER_QUIET;
+}
+
+
+
+// ------------------------
+void CardVolume::step(bool busy)	{
+// ------------------------
+	if(!mounted || !CARD_IDLE_RELEASE)
+		return;
+
+	if(busy)
+		lastUse = millis();
+	else if(millis() - lastUse >= CARD_IDLE_RELEASE)
+		release();
+}
+
+
+
+// ------------------------
+void CardVolume::release()	{
+// ------------------------
+	if(!mounted)
+		return;
+
+	sectors.syncDevice();
+	sd.card()->spiStop();
+
+	// floating pins leave the card to the printer
+	SPI.end();
+	pinMode(csPin, INPUT);
+
+	mounted = false;
+	released = true;
+	releaseCount = senseCount;
+}
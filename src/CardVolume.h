@@ -0,0 +1,94 @@
+#ifndef CARDVOLUME_H
+#define CARDVOLUME_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "SectorCache.h"
+
+// the card is handed back to the printer after this long without use, 0 keeps it
+#define CARD_IDLE_RELEASE		10000
+// the printer counts as busy with the card until it didn't select it for this long
+#define CARD_PRINTER_QUIET		2000
+
+// SPI clocks tried on a new card, the one below the fastest that passes the test is used
+#define CARD_SAFE_CLOCK			4000000
+// sectors read to test a clock, also the size of the scratch file written
+#define CARD_TEST_SECTORS		8
+// reads of the test sectors that all have to match
+#define CARD_TEST_PASSES		4
+#define CARD_SCRATCH_FILE		"/~clocktest.tmp"
+// cards whose clock is kept in the EEPROM sector of the flash
+#define CARD_CLOCK_CARDS		4
+
+// The SD card, mounted once for WebDAV and FTP. With one volume both see
+// the same FAT and directory sectors through the same cache, a file
+// written by one of them can't hide behind a stale sector of the other.
+//
+// While nobody uses the card the SPI pins are released so the printer has
+// the card for itself. The printer's chip select is watched meanwhile: if it
+// never touched the card, the next mount only checks the card and its boot
+// sector against what was seen before and keeps all caches. A released card
+// isn't taken back while the printer is using it.
+//
+// The SPI clock is found per card: the FAT sectors are read at a safe clock
+// first, then at each faster clock until they read back the same and a
+// pattern written to a scratch file reads back unchanged. The next slower
+// clock is used, the fastest that passes is at the card's edge. Commands
+// and data carry CRCs (USE_SD_CRC), so a write garbled on the way is
+// refused by the card instead of landing on another sector. The clock is
+// remembered by the card's CID and only verified by the reads next time.
+//
+// The volume reads and writes through a sector cache. Raw transfers on
+// sd.card() bypass it and invalidate the sectors they write.
+class CardVolume	{
+public:
+	void begin(int8_t sensePin);
+	bool mount(const sdfat::SdSpiConfig& config);
+	void step(bool busy);
+	void release();
+	bool isMounted()			{ return mounted; }
+	bool printerBusy();
+	uint32_t clock()			{ return clockRate; }
+	uint32_t readSpeed()		{ return readKBps; }
+	sdfat::SdFat& volume()		{ return sd; }
+	SectorCache& cache()		{ return sectors; }
+
+protected:
+	bool beginTuned(const sdfat::SdSpiConfig& config);
+	bool readTest(uint32_t reference);
+	bool writeTest(uint32_t scratch);
+	bool readSectorsCrc(uint32_t *crc);
+	uint32_t cidKey();
+	uint32_t loadClock(uint32_t key);
+	void saveClock(uint32_t key, uint32_t rate);
+	bool attach(bool clear);
+	bool resume();
+	void remember();
+	bool sameGeometry();
+	static void senseInterrupt();
+
+	sdfat::SdFat sd;
+	SectorCache	sectors;
+	bool		mounted = false;
+	bool		released = false;
+	bool		sensing = false;
+	uint8_t		csPin;
+	uint8_t		spiOptions;
+	uint32_t	clockRate = 0;
+	uint32_t	readKBps = 0;	// measured while testing the clock
+	uint32_t	lastUse;
+	uint32_t	releaseCount;	// printer selections counted when the card was released
+
+	// what the card looked like when it was last mounted
+	sdfat::cid_t cid;
+	uint32_t	fatStart;
+	uint32_t	dataStart;
+	uint32_t	clusters;
+
+	static volatile uint32_t senseCount;
+	static volatile uint32_t lastSense;
+};
+
+extern CardVolume cardVolume;
+
+#endif // CARDVOLUME_H
@@ -0,0 +1,97 @@
+#include "ChangeJournal.h"
+
+ChangeJournal changeJournal;
+
+static const char *typeNames[] = { "written", "created", "deleted", "moved" };
+
+// ------------------------
+static String jsonString(const String& text)	{
+// ------------------------
+	String quoted = "\"";
+	for(unsigned int i = 0; i < text.length(); i++)	{
+		char c = text[i];
+		if(c == '"' || c == '\\')
+			quoted += '\\';
+		quoted += c;
+	}
+	return quoted + "\"";
+}
+
+
+
+// ------------------------
+void ChangeJournal::record(ChangeType type, const String& path, const String& to)	{
+// ------------------------
+	// the oldest entry is overwritten
+	Entry *entry = &entries[seq % JOURNAL_ENTRIES];
+	entry->seq = ++seq;
+	entry->type = type;
+	entry->path = path;
+	entry->to = to;
+}
+
+
+
+// ------------------------
+bool ChangeJournal::hasChanges(uint32_t since, const String& prefix)	{
+// ------------------------
+	if(isLost(since))
+		return true;
+
+	for(uint32_t n = since + 1; n <= seq; n++)
+		if(matches(entries[(n - 1) % JOURNAL_ENTRIES], prefix))
+			return true;
+
+	return false;
+}
+
+
+
+// ------------------------
+String ChangeJournal::report(uint32_t since, const String& prefix)	{
+// ------------------------
+	// {"seq":12,"lost":false,"changes":[{"seq":11,"type":"moved","path":"/a","to":"/b"}]}
+	bool lost = isLost(since);
+	String json = "{\"seq\":" + String(seq) + ",\"lost\":" + (lost ? "true" : "false") + ",\"changes\":[";
+
+	bool first = true;
+	for(uint32_t n = lost ? seq + 1 : since + 1; n <= seq; n++)	{
+		const Entry& entry = entries[(n - 1) % JOURNAL_ENTRIES];
+		if(!matches(entry, prefix))
+			continue;
+
+		if(!first)
+			json += ",";
+		first = false;
+
+		json += "{\"seq\":" + String(entry.seq) + ",\"type\":\"" + typeNames[entry.type] + "\",\"path\":" + jsonString(entry.path);
+		if(entry.type == CHANGE_MOVED)
+			json += ",\"to\":" + jsonString(entry.to);
+		json += "}";
+	}
+
+	return json + "]}";
+}
+
+
+
+// ------------------------
+bool ChangeJournal::matches(const Entry& entry, const String& prefix)	{
+// ------------------------
+	// the directory asked for and everything below it
+	if(prefix.length() == 0 || prefix == "/")
+		return true;
+
+	String dir = prefix.endsWith("/") ? prefix : prefix + "/";
+	return entry.path.startsWith(dir) || entry.path + "/" == dir ||
+		(entry.type == CHANGE_MOVED && (entry.to.startsWith(dir) || entry.to + "/" == dir));
+}
+
+
+
+// ------------------------
+bool ChangeJournal::isLost(uint32_t since)	{
+// ------------------------
+	// overwritten already, or from before a restart
+	return since > seq || seq - since > JOURNAL_ENTRIES;
+}
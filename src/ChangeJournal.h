@@ -0,0 +1,39 @@
+#ifndef CHANGEJOURNAL_H
+#define CHANGEJOURNAL_H
+
+#include <Arduino.h>
+
+// changes kept, older ones are lost to clients that fell behind
+#define JOURNAL_ENTRIES		32
+
+enum ChangeType { CHANGE_WRITTEN, CHANGE_CREATED, CHANGE_DELETED, CHANGE_MOVED };
+
+// What WebDAV and FTP changed on the card, numbered in order. Clients ask
+// for the changes after the last number they saw instead of listing
+// directories again. Numbers start over at boot; a client asking for a
+// number that is not known is told to list everything again.
+class ChangeJournal	{
+public:
+	void record(ChangeType type, const String& path, const String& to = String());
+	uint32_t latest()			{ return seq; }
+	bool hasChanges(uint32_t since, const String& prefix);
+	String report(uint32_t since, const String& prefix);
+
+protected:
+	struct Entry	{
+		uint32_t	seq;
+		ChangeType	type;
+		String		path;
+		String		to;			// new path of a move
+	};
+
+	bool matches(const Entry& entry, const String& prefix);
+	bool isLost(uint32_t since);
+
+	Entry		entries[JOURNAL_ENTRIES];
+	uint32_t	seq = 0;
+};
+
+extern ChangeJournal changeJournal;
+
+#endif // CHANGEJOURNAL_H
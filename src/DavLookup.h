@@ -0,0 +1,158 @@
+#ifndef DAVLOOKUP_H
+#define DAVLOOKUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+// Request methods and content types, resolved through tables the compiler
+// builds. Nothing here depends on Arduino, bench/lookup_bench.cpp measures
+// these lookups on the host against the if-chains they replaced.
+
+enum DavMethod { METHOD_UNKNOWN, METHOD_GET, METHOD_HEAD, METHOD_PUT, METHOD_POST, METHOD_OPTIONS, METHOD_PROPFIND, METHOD_PROPPATCH,
+	METHOD_MKCOL, METHOD_MOVE, METHOD_COPY, METHOD_DELETE, METHOD_LOCK, METHOD_UNLOCK };
+
+// extensions without the dot in lower case, WEBDAV_PRINT_MIME_TYPES adds
+// the files of 3D printing
+struct MimeType	{
+	const char	*ext;
+	const char	*type;
+};
+
+static constexpr MimeType mimeTypes[] = {
+	{ "html", "text/html" },
+	{ "htm", "text/html" },
+	{ "css", "text/css" },
+	{ "txt", "text/plain" },
+	{ "js", "application/javascript" },
+	{ "json", "application/json" },
+	{ "png", "image/png" },
+	{ "gif", "image/gif" },
+	{ "jpg", "image/jpeg" },
+	{ "ico", "image/x-icon" },
+	{ "svg", "image/svg+xml" },
+	{ "ttf", "application/x-font-ttf" },
+	{ "otf", "application/x-font-opentype" },
+	{ "woff", "application/font-woff" },
+	{ "woff2", "application/font-woff2" },
+	{ "eot", "application/vnd.ms-fontobject" },
+	{ "sfnt", "application/font-sfnt" },
+	{ "xml", "text/xml" },
+	{ "pdf", "application/pdf" },
+	{ "zip", "application/zip" },
+	{ "gz", "application/x-gzip" },
+	{ "appcache", "text/cache-manifest" },
+#ifdef WEBDAV_PRINT_MIME_TYPES
+	{ "gcode", "text/x-gcode" },
+	{ "gco", "text/x-gcode" },
+	{ "g", "text/x-gcode" },
+	{ "3mf", "model/3mf" },
+	{ "stl", "model/stl" },
+	{ "obj", "model/obj" },
+#endif
+};
+
+static constexpr size_t numMimeTypes = sizeof(mimeTypes) / sizeof(mimeTypes[0]);
+
+// hash table slots, well above the number of types
+#define MIME_SLOT_BITS	7
+#define MIME_SLOTS		(1 << MIME_SLOT_BITS)
+
+// FNV-1a over the extension, letters folded to lower case. The top bits
+// are used, all of the seed and the name have an effect on them.
+static constexpr uint32_t mimeHash(const char *ext, uint32_t seed)	{
+	uint32_t h = 2166136261u ^ seed;
+	for(; *ext; ext++)
+		h = (h ^ (uint8_t) (*ext | 0x20)) * 16777619u;
+	return h >> (32 - MIME_SLOT_BITS);
+}
+
+// the compiler tries seeds until every type has a slot of its own
+static constexpr bool isPerfect(uint32_t seed)	{
+	bool used[MIME_SLOTS] = {};
+	for(size_t i = 0; i < numMimeTypes; i++)	{
+		uint32_t slot = mimeHash(mimeTypes[i].ext, seed);
+		if(used[slot])
+			return false;
+		used[slot] = true;
+	}
+	return true;
+}
+
+static constexpr uint32_t findSeed()	{
+	uint32_t seed = 0;
+	while(!isPerfect(seed))
+		seed++;
+	return seed;
+}
+
+struct MimeSlots	{
+	uint8_t		index[MIME_SLOTS];
+};
+
+static constexpr uint32_t mimeSeed = findSeed();
+
+static constexpr MimeSlots buildSlots()	{
+	MimeSlots slots = {};
+	for(size_t i = 0; i < MIME_SLOTS; i++)
+		slots.index[i] = 0xff;
+	for(size_t i = 0; i < numMimeTypes; i++)
+		slots.index[mimeHash(mimeTypes[i].ext, mimeSeed)] = i;
+	return slots;
+}
+
+static constexpr MimeSlots mimeSlots = buildSlots();
+
+
+
+// ------------------------
+static inline const char *lookupMimeType(const char *ext)	{
+// ------------------------
+	// one slot to look at, the extension there is confirmed
+	uint8_t i = mimeSlots.index[mimeHash(ext, mimeSeed)];
+	if(i != 0xff && !strcasecmp(ext, mimeTypes[i].ext))
+		return mimeTypes[i].type;
+
+	return NULL;
+}
+
+
+
+// FNV-1a, evaluated by the compiler for the case labels of parseMethod()
+static constexpr uint32_t methodHash(const char *name)	{
+	uint32_t h = 2166136261u;
+	for(; *name; name++)
+		h = (h ^ (uint8_t) *name) * 16777619u;
+	return h;
+}
+
+// in the order of DavMethod
+static const char * const methodNames[] = { "", "GET", "HEAD", "PUT", "POST", "OPTIONS", "PROPFIND", "PROPPATCH", "MKCOL", "MOVE", "COPY", "DELETE", "LOCK", "UNLOCK" };
+
+// ------------------------
+static inline DavMethod parseMethod(const char *name)	{
+// ------------------------
+	// two methods with the same hash wouldn't compile, a match is confirmed once
+	DavMethod id;
+	switch(methodHash(name))	{
+	case methodHash("GET"):			id = METHOD_GET; break;
+	case methodHash("HEAD"):		id = METHOD_HEAD; break;
+	case methodHash("PUT"):			id = METHOD_PUT; break;
+	case methodHash("POST"):		id = METHOD_POST; break;
+	case methodHash("OPTIONS"):		id = METHOD_OPTIONS; break;
+	case methodHash("PROPFIND"):	id = METHOD_PROPFIND; break;
+	case methodHash("PROPPATCH"):	id = METHOD_PROPPATCH; break;
+	case methodHash("MKCOL"):		id = METHOD_MKCOL; break;
+	case methodHash("MOVE"):		id = METHOD_MOVE; break;
+	case methodHash("COPY"):		id = METHOD_COPY; break;
+	case methodHash("DELETE"):		id = METHOD_DELETE; break;
+	case methodHash("LOCK"):		id = METHOD_LOCK; break;
+	case methodHash("UNLOCK"):		id = METHOD_UNLOCK; break;
+	default:						return METHOD_UNKNOWN;
+	}
+
+	return strcmp(name, methodNames[id]) ? METHOD_UNKNOWN : id;
+}
+
+#endif // DAVLOOKUP_H
@@ -0,0 +1,262 @@
+#include "Defragmenter.h"
+#include "CardVolume.h"
+#include "CardCache.h"
+#include "FreeSpace.h"
+
+using namespace sdfat;
+
+Defragmenter defragmenter;
+
+// ------------------------
+void Defragmenter::mount()	{
+// ------------------------
+	// called on every full mount, the card may have been pulled during a switch
+	recoverPending = true;
+}
+
+
+
+// ------------------------
+bool Defragmenter::start(const String& root)	{
+// ------------------------
+	// a run recovers what it comes across, the whole card still has to be searched
+	if(walker && recovering)	{
+		delete walker;
+		walker = NULL;
+	}
+	if(walker)
+		return false;
+
+	walker = new TreeWalker();
+	if(!walker->begin(root))	{
+		delete walker;
+		walker = NULL;
+		return false;
+	}
+
+	numDone = 0;
+	retryPath = "";
+	recovering = false;
+	wholeCard = root == "/";
+	return true;
+}
+
+
+
+// ------------------------
+void Defragmenter::step()	{
+// ------------------------
+	if(!walker && recoverPending)	{
+		walker = new TreeWalker();
+		if(!walker->begin("/"))	{
+			delete walker;
+			walker = NULL;
+			return;
+		}
+		numDone = 0;
+		recovering = true;
+		wholeCard = true;
+	}
+	if(!walker)
+		return;
+
+	uint32_t sliceStart = millis();
+	SdCard *card = cardVolume.volume().card();
+
+	while((millis() - sliceStart) < DEFRAG_SLICE_MS)	{
+		if(buf)	{
+			// copy the current file into its extent
+			if(blockPos < numBlocks)	{
+				uint32_t n = min((uint32_t) DEFRAG_COPY_SECTORS, numBlocks - blockPos);
+				cardVolume.cache().invalidate(bgnBlock + blockPos, n);
+				if(src.read(buf, n * 512) <= 0 || !card->writeSectors(bgnBlock + blockPos, buf, n))	{
+					endFile(false);
+					continue;
+				}
+				blockPos += n;
+				continue;
+			}
+
+			endFile(true);
+			continue;
+		}
+
+		// a file a client interrupted is started over
+		if(retryPath.length())	{
+			String path = retryPath;
+			retryPath = "";
+			beginFile(path);
+			continue;
+		}
+
+		if(!walker->next())	{
+			if(!recovering)	{
+				Serial.print(numDone); Serial.println(" files defragmented");
+			}
+			if(wholeCard)
+				recoverPending = false;
+			delete walker;
+			walker = NULL;
+			return;
+		}
+
+		if(walker->entry() != WALK_FILE)
+			continue;
+		if(walker->path().endsWith(DEFRAG_SUFFIX))
+			recover(walker->path());
+		else if(!recovering && walker->size() >= DEFRAG_MIN_SIZE && isFragmented(walker->path()))
+			beginFile(walker->path());
+	}
+}
+
+
+
+// ------------------------
+void Defragmenter::cancel()	{
+// ------------------------
+	if(!buf)
+		return;
+
+	retryPath = srcPath;
+	endFile(false);
+}
+
+
+
+// ------------------------
+void Defragmenter::stop()	{
+// ------------------------
+	if(!walker)
+		return;
+
+	if(buf)
+		endFile(false);
+
+	if(!recovering)	{
+		Serial.print(numDone); Serial.println(" files defragmented, stopped");
+	}
+	delete walker;
+	walker = NULL;
+}
+
+
+
+// ------------------------
+bool Defragmenter::isFragmented(const String& path)	{
+// ------------------------
+	FatFile file;
+	uint32_t bgn, end;
+	if(!file.open(path.c_str(), O_READ))
+		return false;
+	return !file.contiguousRange(&bgn, &end);
+}
+
+
+
+// ------------------------
+void Defragmenter::recover(const String& tmpPath)	{
+// ------------------------
+	String path = tmpPath.substring(0, tmpPath.length() - strlen(DEFRAG_SUFFIX));
+	SdFat& sd = cardVolume.volume();
+
+	// the original was removed, so the copy was complete
+	if(!sd.exists(path.c_str()))	{
+		if(sd.rename(tmpPath.c_str(), path.c_str()))
+			cardChanged(path);
+		return;
+	}
+
+	FatFile tmp;
+	if(tmp.open(tmpPath.c_str(), O_RDWR))	{
+		freeSpace.resized(tmp.fileSize(), 0);
+		tmp.remove();
+	}
+	cardChanged(tmpPath);
+}
+
+
+
+// ------------------------
+bool Defragmenter::beginFile(const String& path)	{
+// ------------------------
+	String tmpPath = path + DEFRAG_SUFFIX;
+	if(!src.open(path.c_str(), O_READ))
+		return false;
+
+	// without a contiguous extent of that size the file stays as it is
+	uint32_t endBlock;
+	uint32_t size = src.fileSize();
+	cardVolume.volume().remove(tmpPath.c_str());
+	if(!dst.createContiguous(tmpPath.c_str(), size) || !dst.contiguousRange(&bgnBlock, &endBlock))	{
+		dst.remove();
+		src.close();
+		return false;
+	}
+	freeSpace.resized(0, size);
+
+	srcPath = path;
+	buf = (uint8_t *) malloc(DEFRAG_COPY_SECTORS * 512);
+	if(!buf)	{
+		endFile(false);
+		return false;
+	}
+
+	numBlocks = (size + 511) / 512;
+	blockPos = 0;
+	return true;
+}
+
+
+
+// ------------------------
+void Defragmenter::endFile(bool ok)	{
+// ------------------------
+	String tmpPath = srcPath + DEFRAG_SUFFIX;
+	free(buf);
+	buf = NULL;
+
+	// the copy keeps the times of the original
+	uint16_t pdate, ptime;
+	if(ok && src.getModifyDateTime(&pdate, &ptime))
+		ok = dst.timestamp(T_WRITE, FS_YEAR(pdate), FS_MONTH(pdate), FS_DAY(pdate), FS_HOUR(ptime), FS_MINUTE(ptime), FS_SECOND(ptime));
+	if(ok && src.getCreateDateTime(&pdate, &ptime))
+		ok = dst.timestamp(T_CREATE, FS_YEAR(pdate), FS_MONTH(pdate), FS_DAY(pdate), FS_HOUR(ptime), FS_MINUTE(ptime), FS_SECOND(ptime));
+
+	// a read-only original has to be made writable to be removed
+	uint8_t attributes = src.attrib() & FS_ATTRIB_USER_SETTABLE;
+	if(ok && (attributes & FS_ATTRIB_READ_ONLY))
+		ok = src.attrib(attributes & ~FS_ATTRIB_READ_ONLY);
+
+	uint32_t size = src.fileSize();
+	src.close();
+	if(!ok)	{
+		freeSpace.resized(dst.fileSize(), 0);
+		dst.remove();
+		return;
+	}
+	dst.close();
+
+	// switch over, the copy is complete before the original goes
+	SdFat& sd = cardVolume.volume();
+	if(!sd.remove(srcPath.c_str()))	{
+		freeSpace.resized(size, 0);
+		sd.remove(tmpPath.c_str());
+		FatFile orig;
+		if(orig.open(srcPath.c_str(), O_READ))
+			orig.attrib(attributes);
+		return;
+	}
+	freeSpace.resized(size, 0);
+
+	// the bits are set last, a read-only copy couldn't be renamed
+	FatFile copy;
+	if(sd.rename(tmpPath.c_str(), srcPath.c_str()) && copy.open(srcPath.c_str(), O_READ))
+		copy.attrib(attributes);
+	copy.close();
+
+	// the sectors of the file moved, its cached map has to go
+	cardChanged(srcPath);
+	numDone++;
+	totalFiles++;
+	totalBytes += size;
+}
@@ -0,0 +1,66 @@
+#ifndef DEFRAGMENTER_H
+#define DEFRAGMENTER_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "TreeWalker.h"
+
+// smaller files read fast enough in pieces
+#define DEFRAG_MIN_SIZE		(256UL * 1024)
+// time the defragmenter may use per loop() while the card is idle
+#define DEFRAG_SLICE_MS		20
+// sectors copied per transfer
+#define DEFRAG_COPY_SECTORS	4
+// a copy is written under the file's name with this appended
+#define DEFRAG_SUFFIX		".defrag~"
+
+// Rewrites fragmented files below a directory into one contiguous extent,
+// so GET, RETR and the printer can read them with multi block reads. A copy
+// is written next to the file and switched over by removing the file and
+// renaming the copy, which takes over the times and attribute bits. A copy
+// found without its original was interrupted during the switch and is
+// renamed, any other copy is dropped. Every full mount looks for such
+// copies, a run does it on the way.
+//
+// Work is done in slices from loop() while nobody else uses the card. A
+// client stops the file being copied, it is copied again from the start
+// once the card is idle. The printer stops the whole run, a search for
+// leftover copies is started again.
+class Defragmenter	{
+public:
+	void mount();
+	bool start(const String& root);
+	bool isRunning()			{ return walker != NULL; }
+	void step();
+	void cancel();
+	void stop();
+
+	uint32_t numFiles()			{ return totalFiles; }
+	uint32_t numBytes()			{ return totalBytes; }
+
+protected:
+	bool isFragmented(const String& path);
+	void recover(const String& tmpPath);
+	bool beginFile(const String& path);
+	void endFile(bool ok);
+
+	TreeWalker	*walker = NULL;
+	uint8_t		*buf = NULL;
+	sdfat::FatFile src;
+	sdfat::FatFile dst;
+	String		srcPath;
+	String		retryPath;		// file whose copy a client cancelled
+	bool		recoverPending = false;	// leftover copies still to be looked for
+	bool		recovering;		// the walk only looks for them
+	bool		wholeCard;		// the walk covers all of the card
+	uint32_t	bgnBlock;
+	uint32_t	numBlocks;
+	uint32_t	blockPos;
+	uint16_t	numDone;
+	uint32_t	totalFiles = 0;
+	uint32_t	totalBytes = 0;
+};
+
+extern Defragmenter defragmenter;
+
+#endif // DEFRAGMENTER_H
@@ -22,6 +22,12 @@
  */
 
 #include "ESPFtpServer.h"
+#include "CardCache.h"
+#include "SidecarBuilder.h"
+#include "FreeSpace.h"
+#include "ChangeJournal.h"
+#include "UploadSpool.h"
+#include "Defragmenter.h"
 
 #include <ESP8266WiFi.h>
 #include <WiFiClient.h>
@@ -62,6 +68,7 @@ void FtpServer::iniVariables()
 
   rnfrCmd = false;
   transferStatus = 0;
+  storeSpooled = false;
 }
 
 void FtpServer::handleFTP()
@@ -129,7 +136,12 @@ void FtpServer::handleFTP()
       }
     else if (cmdStatus == 5) // Ftp server waiting for user command
     {
-      if (!processCommand())
+      // the card may have been handed back to the printer in the meantime,
+      // it isn't taken back while the printer reads from it; commands that
+      // don't use it are answered anyway, STOR goes to the upload spool
+      if (needsCard() && !initSD())
+        client.println("450 SD card in use by the printer, try again later");
+      else if (!processCommand())
       {
         cmdStatus = 0;
       }
@@ -223,6 +235,12 @@ boolean FtpServer::userPassword()
 
 boolean FtpServer::processCommand()
 {
+  // background work on the card gives way before a command changes it
+  if (isMutating())
+  {
+    defragmenter.cancel();
+    uploadSpool.cancel();
+  }
 
   ///////////////////////////////////////
   //                                   //
@@ -419,9 +437,17 @@ boolean FtpServer::processCommand()
       }
       else
       {
+        FatFile victim;
+        uint32_t size = victim.open(path, O_READ) ? victim.fileSize() : 0;
+        victim.close();
+
         //try.. if( SPIFFS.remove( path ))
         if (SD.remove(path))
         {
+          cardChanged(path);
+          sidecarBuilder.drop(path);
+          freeSpace.resized(size, 0);
+          changeJournal.record(CHANGE_DELETED, path);
           client.println("250 Deleted " + String(parameters));
         }
         else
@@ -660,16 +686,34 @@ boolean FtpServer::processCommand()
       client.println("501 No file name");
     else if (makePath(path))
     {
-      //file = SPIFFS.open(path, "w");
-      //try.. file = SD.open(path, "w");
-      file.open(path, FILE_WRITE);
-      //file.open(path, O_CREAT | O_WRITE);
-      if (!file.isOpen())
+      // without the card the file is spooled, and so is one that a spooled
+      // upload of the same file would be committed over
+      SpoolResult spoolResult = SPOOL_OK;
+      storeSpooled = uploadSpool.isQueued(path) || !initSD();
+      if (storeSpooled)
+        spoolResult = uploadSpool.create(&spoolFile, path, 0);
+      else
+      {
+        //file = SPIFFS.open(path, "w");
+        //try.. file = SD.open(path, "w");
+        file.open(path, FILE_WRITE);
+        //file.open(path, O_CREAT | O_WRITE);
+        cardChanged(path);
+        sidecarBuilder.drop(path);
+      }
+      if (spoolResult == SPOOL_NO_FOLDER)
+        client.println("553 The folder of " + String(parameters) + " doesn't exist");
+      else if (spoolResult == SPOOL_FULL)
+        client.println("452 No room to store " + String(parameters) + " until the printer is done with the card");
+      else if (!storeSpooled && !file.isOpen())
         client.println("451 Can't open/create " + String(parameters));
       else if (!dataConnect())
       {
         client.println("425 No data connection");
-        file.close();
+        if (storeSpooled)
+          uploadSpool.discard(&spoolFile);
+        else
+          file.close();
       }
       else
       {
@@ -679,6 +723,8 @@ boolean FtpServer::processCommand()
         client.println("150 Connected to port " + String(dataPort));
         millisBeginTrans = millis();
         bytesTransfered = 0;
+        storeStartSize = file.fileSize();
+        storePath = path;
         transferStatus = 2;
 
         // // high speed raw write implementation
@@ -726,7 +772,12 @@ boolean FtpServer::processCommand()
     if (!SD.mkdir(path, true))
       client.println("550 Can't create \"" + String(parameters));
     else
+    {
+      cardChanged(path);
+      freeSpace.dirCreated();
+      changeJournal.record(CHANGE_CREATED, path);
       client.println("200 Directory " + String(parameters) + " created");
+    }
   }
   //
   //  RMD - Remove a Directory
@@ -750,7 +801,12 @@ boolean FtpServer::processCommand()
     if (!SD.rmdir(path))
       client.println("501 Can't delete \"" + String(parameters));
     else
+    {
+      cardChanged(path);
+      freeSpace.dirRemoved();
+      changeJournal.record(CHANGE_DELETED, path);
       client.println("200 Directory " + String(parameters) + " deleted");
+    }
   }
   //
   //  RNFR - Rename From
@@ -798,8 +854,15 @@ boolean FtpServer::processCommand()
       if (!SD.rename(buf, path))
         client.println("451 Rename/move from " + String(buf) + " to " + String(path) + " failure"); 
       else
+      {
+        cardChanged(buf);
+        cardChanged(path);
+        sidecarBuilder.drop(buf);
+        sidecarBuilder.drop(path);
+        changeJournal.record(CHANGE_MOVED, buf, path);
         client.println("200 Rename/move of file or directory from " + String(buf) + " to " + String(path) + " successfully"); 
       }
+      }
     }
     rnfrCmd = false;
   }
@@ -817,6 +880,7 @@ boolean FtpServer::processCommand()
   {
     client.println("211-Extensions suported:");
     client.println(" MLSD");
+    client.println(" AVBL");
     client.println("211 End.");
   }
   //
@@ -848,6 +912,16 @@ boolean FtpServer::processCommand()
     }
   }
   //
+  //  AVBL - Available space (draft-peterson-streamlined-ftp-command-extensions)
+  //
+  else if (!strcmp(command, "AVBL"))
+  {
+    if (!freeSpace.isKnown())
+      client.println("550 Free space not known yet");
+    else
+      client.println("213 " + String(freeSpace.freeBytes()));
+  }
+  //
   //  SITE - System command
   //
   else if (!strcmp(command, "SITE"))
@@ -887,6 +961,29 @@ boolean FtpServer::dataConnect()
   return data.connected();
 }
 
+boolean FtpServer::isTransferring()
+{
+  return transferStatus > 0;
+}
+
+boolean FtpServer::isMutating()
+{
+  static const char *commands[] = { "DELE", "RNFR", "RNTO", "MKD", "RMD", "STOR", "APPE" };
+  for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    if (!strcmp(command, commands[i]))
+      return true;
+  return false;
+}
+
+boolean FtpServer::needsCard()
+{
+  static const char *commands[] = { "CDUP", "PWD", "QUIT", "MODE", "PASV", "PORT", "STRU", "TYPE", "ABOR", "NOOP", "STOR", "FEAT", "SITE" };
+  for (unsigned int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    if (!strcmp(command, commands[i]))
+      return false;
+  return true;
+}
+
 boolean FtpServer::doRetrieve()
 {
   //int16_t nb = file.readBytes((uint8_t*) buf, FTP_BUF_SIZE );
@@ -907,14 +1004,39 @@ boolean FtpServer::doStore()
   if (data.connected())
   {
     int16_t nb = data.readBytes((uint8_t *)buf, FTP_BUF_SIZE);
+    if (nb > 0 && storeSpooled && spoolFile.write((uint8_t *)buf, nb) != (size_t)nb)
+    {
+      // the flash is full, the length wasn't known to be checked up front
+      uploadSpool.discard(&spoolFile);
+      data.stop();
+      client.println("452 No room to store the file until the printer is done with the card");
+      return false;
+    }
     if (nb > 0)
     {
       // Serial.println( millis() << " " << nb << endl;
-      file.write((uint8_t *)buf, nb);
+      if (!storeSpooled)
+        file.write((uint8_t *)buf, nb);
       bytesTransfered += nb;
     }
     return true;
   }
+  // a spooled file reaches the card, its caches and the journal on commit
+  if (storeSpooled)
+  {
+    if (uploadSpool.finish(&spoolFile))
+      closeTransfer();
+    else
+    {
+      data.stop();
+      client.println("451 Can't spool " + storePath);
+    }
+    return false;
+  }
+  // the file name is gone by now, listings read during the upload show a partial size
+  propCache.clear();
+  freeSpace.resized(storeStartSize, file.fileSize());
+  changeJournal.record(CHANGE_WRITTEN, storePath);
   closeTransfer();
   return false;
 }
@@ -938,6 +1060,13 @@ void FtpServer::abortTransfer()
 {
   if (transferStatus > 0)
   {
+    if (transferStatus == 2 && storeSpooled)
+      uploadSpool.discard(&spoolFile);
+    else if (transferStatus == 2)
+    {
+      propCache.clear();
+      freeSpace.resized(storeStartSize, file.fileSize());
+    }
     file.close();
     data.stop();
     client.println("426 Transfer aborted");
@@ -1142,21 +1271,16 @@ char *FtpServer::makeDateTimeStr(char *tstr, uint16_t date, uint16_t time)
 bool FtpServer::initSD()
 {
   // ------------------------
-  // initialize the SD card
-  if (!isSDInit)
-  {
-    isSDInit = true;
-    bool ret = SD.begin(*sdconfig);
+  // initialize the SD card, WebDAV may have mounted it already
+  if (cardVolume.isMounted())
+    return true;
 
-    if (!ret)
-      Serial.println("FTP: Error opening SD card");
-    else
-      Serial.println("FTP: SD card init was successful");
+  bool ret = cardVolume.mount(*sdconfig);
 
-    return ret;
-  }
+  if (!ret)
+    Serial.println("FTP: Error opening SD card");
   else
-  {
-    return true;
-  }
+    Serial.println("FTP: SD card init was successful");
+
+  return ret;
 }
@@ -33,6 +33,8 @@
 #include <SdFat.h>
 #include <WiFiClient.h>
 #include "Version.h"
+#include "CardVolume.h"
+#include "UploadSpool.h"
 
 #define FTP_DEBUG 1
 
@@ -54,6 +56,7 @@ class FtpServer
 public:
   void    begin(String uname, String pword, sdfat::SdSpiConfig * config);
   void    handleFTP();
+  boolean isTransferring();
   
   int8_t   cmdStatus,SD_Status;                 // status of ftp command connexion
 
@@ -64,6 +67,8 @@ private:
   boolean userIdentity();
   boolean userPassword();
   boolean processCommand();
+  boolean isMutating();
+  boolean needsCard();
   boolean dataConnect();
   boolean doRetrieve();
   boolean doStore();
@@ -82,7 +87,7 @@ private:
   WiFiClient data;
   
   sdfat::FatFile file;
-  sdfat::SdFat SD;
+  sdfat::SdFat& SD = cardVolume.volume();   // shared with the WebDAV server
   sdfat::SdSpiConfig * sdconfig;
   
   boolean  dataPassiveConn;
@@ -99,12 +104,14 @@ private:
            millisDelay,
            millisEndConnection,       // 
            millisBeginTrans,          // store time of beginning of a transaction
-           bytesTransfered;           //
+           bytesTransfered,           //
+           storeStartSize;            // size of the file STOR appends to
+  String   storePath;                 // file being received by STOR
+  boolean  storeSpooled;              // STOR goes to the upload spool
+  fs::File spoolFile;                 // its spool file
   String   _FTP_USER;
   String   _FTP_PASS;
 
-  // SD stuff
-	bool isSDInit = false;
 };
 
 #endif // FTP_SERVERESP_H
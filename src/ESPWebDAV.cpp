@@ -6,6 +6,7 @@
 #include <SdFat.h>
 #include <Hash.h>
 #include <time.h>
+#include <errno.h>
 #include "ESPWebDAV.h"
 
 using namespace sdfat;
@@ -28,20 +29,12 @@ bool ESPWebDAV::init(int serverPort) {
 // ------------------------
 bool ESPWebDAV::initSD(sdfat::SdSpiConfig config) {
 // ------------------------
-	// initialize the SD card
-	if(!isSDInit)
-	{
-		isSDInit = true;
-		return sd.begin(config);
-	}
-	else
-	{
-		return true;
-	}
+	// the card is shared with the FTP server and may have been handed back to the printer
+	return cardVolume.mount(config);
 }
 
 // ------------------------
-void ESPWebDAV::handleNotFound() {
+void DavConnection::handleNotFound() {
 // ------------------------
 	String message = "Not found\n";
 	message += "URI: ";
@@ -58,16 +51,16 @@ void ESPWebDAV::handleNotFound() {
 
 
 // ------------------------
-void ESPWebDAV::handleReject(String rejectMessage)	{
+void DavConnection::handleReject(String rejectMessage)	{
 // ------------------------
 	DBG_PRINT("Rejecting request: "); DBG_PRINTLN(rejectMessage);
 
 	// handle options
-	if(method.equals("OPTIONS"))
+	if(methodId == METHOD_OPTIONS)
 		return handleOptions(RESOURCE_NONE);
 	
 	// handle properties
-	if(method.equals("PROPFIND"))	{
+	if(methodId == METHOD_PROPFIND)	{
 		sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE");
 		setContentLength(CONTENT_LENGTH_UNKNOWN);
 		send("207 Multi-Status", "application/xml;charset=utf-8", "");
@@ -95,16 +88,54 @@ void ESPWebDAV::handleReject(String rejectMessage)	{
 // Test PUT a file: curl -v -T c.txt -H "Expect:" http://Rigidbot/c.txt
 // C:\Users\gsbal>curl -v -X LOCK http://Rigidbot/EMA_CPP_TRCC_Tutorial/Consumer.cpp -d "<?xml version=\"1.0\" encoding=\"utf-8\" ?><D:lockinfo xmlns:D=\"DAV:\"><D:lockscope><D:exclusive/></D:lockscope><D:locktype><D:write/></D:locktype><D:owner><D:href>CARBON2\gsbal</D:href></D:owner></D:lockinfo>"
 // ------------------------
-void ESPWebDAV::handleRequest(String blank)	{
+void DavConnection::handleRequest(String blank)	{
 // ------------------------
-	ResourceType resource = RESOURCE_NONE;
+	// jobs need the resource type after the handler returns
+	resource = RESOURCE_NONE;
+	resourceSize = 0;
+	map.clear();
+	spooled = false;
+
+	// changes since a number come from the journal in RAM, watchers are
+	// answered while the printer has the card
+	if(methodId == METHOD_GET && query.startsWith("changes="))
+		return handleChanges();
+
+	// the printer has the card, uploads go to the flash spool and the rest has to wait
+	if(!cardVolume.isMounted())	{
+		sendHeader("DAV", "2");
+		if(methodId == METHOD_OPTIONS)
+			return handleOptions(resource);
+		if(methodId == METHOD_PUT && query.length() == 0)	{
+			spooled = true;
+			return handlePut(resource);
+		}
+		sendHeader("Retry-After", "5");
+		return send("503 Service Unavailable", "text/plain", "The SD card is in use by the printer");
+	}
 
-	// does uri refer to a file or directory or a null?
-	FatFile tFile;
-	if(tFile.open(uri.c_str(), O_READ))	{
-		resource = tFile.isDir() ? RESOURCE_DIR : RESOURCE_FILE;
-		tFile.close();
+	// does uri refer to a file or directory or a null? The path is looked
+	// up once, handlers go on with the open handle and its directory entry.
+	// A cached listing answers PROPFIND without touching the card.
+	uint32_t tResolve = micros();
+	if(methodId == METHOD_PROPFIND)
+		win32Props = wantsWin32Props();
+	bool found;
+	if(methodId == METHOD_PROPFIND && depthHeader.equals("1") && propCache.find(uri, win32Props))	{
+		resource = RESOURCE_DIR;
+		found = false;
+	}
+	else if(methodId == METHOD_GET || methodId == METHOD_HEAD)
+		found = openCached(uri, &file, &map);
+	else
+		found = openPath(&file, uri, O_READ);
+
+	if(found)	{
+		resource = file.isDir() ? RESOURCE_DIR : RESOURCE_FILE;
+		resourceSize = file.fileSize();
+		file.dirEntry(&resourceDir);
 	}
+	DBG_PRINT("Resolved in "); DBG_PRINT(micros() - tResolve); DBG_PRINTLN(" us");
 
 	DBG_PRINT("\r\nm: "); DBG_PRINT(method);
 	DBG_PRINT(" r: "); DBG_PRINT(resource);
@@ -113,46 +144,92 @@ void ESPWebDAV::handleRequest(String blank)	{
 	// add header that gets sent everytime
 	sendHeader("DAV", "2");
 
+	// an upload still waiting in the spool would be committed over this one
+	if(methodId == METHOD_PUT && query.length() == 0 && uploadSpool.isQueued(uri))
+		spooled = true;
+
+	// anything that changes the card drops the listings showing it
+	switch(methodId)	{
+	case METHOD_PUT:
+	case METHOD_MKCOL:
+	case METHOD_MOVE:
+	case METHOD_COPY:
+	case METHOD_DELETE:
+		// these work on paths, PROPPATCH writes the entry through the handle
+		file.close();
+		// fall through
+	case METHOD_PROPPATCH:
+		invalidateCaches();
+		break;
+	default:
+		break;
+	}
+
+	switch(methodId)	{
 	// handle properties
-	if(method.equals("PROPFIND"))
+	case METHOD_PROPFIND:
 		return handleProp(resource);
-	
-	if(method.equals("GET"))
+
+	case METHOD_GET:
+		// a collection downloaded as one tar or zip
+		if(query.startsWith("archive="))
+			return handleArchive(resource);
 		return handleGet(resource, true);
 
-	if(method.equals("HEAD"))
+	case METHOD_HEAD:
 		return handleGet(resource, false);
 
 	// handle options
-	if(method.equals("OPTIONS"))
+	case METHOD_OPTIONS:
 		return handleOptions(resource);
 
-	// handle file create/uploads
-	if(method.equals("PUT"))
+	// handle file create/uploads, a tar archive is unpacked below a directory
+	case METHOD_PUT:
+		if(query.equals("extract"))
+			return handleExtract(resource);
 		return handlePut(resource);
-	
+
+	case METHOD_POST:
+		if(query.equals("extract"))
+			return handleExtract(resource);
+		// maintenance, build gzip sidecars below a directory
+		if(query.equals("compress"))
+			return handleCompress(resource);
+		// maintenance, rewrite fragmented files below a directory
+		if(query.equals("defrag"))
+			return handleDefrag(resource);
+		break;
+
 	// handle file locks
-	if(method.equals("LOCK"))
+	case METHOD_LOCK:
 		return handleLock(resource);
-	
-	if(method.equals("UNLOCK"))
+
+	case METHOD_UNLOCK:
 		return handleUnlock(resource);
-	
-	if(method.equals("PROPPATCH"))
+
+	case METHOD_PROPPATCH:
 		return handlePropPatch(resource);
-	
+
 	// directory creation
-	if(method.equals("MKCOL"))
+	case METHOD_MKCOL:
 		return handleDirectoryCreate(resource);
 
 	// move a file or directory
-	if(method.equals("MOVE"))
+	case METHOD_MOVE:
 		return handleMove(resource);
-	
+
+	// copy a file or directory
+	case METHOD_COPY:
+		return handleCopy(resource);
+
 	// delete a file or directory
-	if(method.equals("DELETE"))
+	case METHOD_DELETE:
 		return handleDelete(resource);
 
+	default:
+		break;
+	}
+
 	// if reached here, means its a 404
 	handleNotFound();
 }
@@ -160,7 +237,7 @@ void ESPWebDAV::handleRequest(String blank)	{
 
 
 // ------------------------
-void ESPWebDAV::handleOptions(ResourceType resource)	{
+void DavConnection::handleOptions(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing OPTION");
 	sendHeader("Allow", "PROPFIND,GET,DELETE,PUT,COPY,MOVE");
@@ -170,7 +247,7 @@ void ESPWebDAV::handleOptions(ResourceType resource)	{
 
 
 // ------------------------
-void ESPWebDAV::handleLock(ResourceType resource)	{
+void DavConnection::handleLock(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing LOCK");
 	
@@ -206,7 +283,7 @@ void ESPWebDAV::handleLock(ResourceType resource)	{
 
 
 // ------------------------
-void ESPWebDAV::handleUnlock(ResourceType resource)	{
+void DavConnection::handleUnlock(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing UNLOCK");
 	sendHeader("Allow", "PROPPATCH,PROPFIND,OPTIONS,DELETE,UNLOCK,COPY,LOCK,MOVE,HEAD,POST,PUT,GET");
@@ -217,16 +294,149 @@ void ESPWebDAV::handleUnlock(ResourceType resource)	{
 
 
 // ------------------------
-void ESPWebDAV::handlePropPatch(ResourceType resource)	{
+void DavConnection::handlePropPatch(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing PROPPATCH");
+
+	// does URI refer to an existing resource
+	if(resource == RESOURCE_NONE)
+		return handleNotFound();
+
+	// the body is small and already received, see isBodyReady()
+	size_t contentLen = contentLengthHeader.toInt();
+	if(contentLen > HTTP_MAX_SMALL_BODY)	{
+		send("413 Request Entity Too Large", NULL, "");
+
+		// the body is read and dropped before the connection is closed,
+		// closing with unread data resets it and the answer may get lost
+		startJob(JOB_DRAIN, CONN_BODY_IN, 512);
+		if(!buf)
+			return endJob();
+		chunkedBody = false;
+		numRemaining = contentLen;
+		bodyDone = false;
+		return;
+	}
+
+	String inXML;
+	inXML.reserve(contentLen);
+	while(inXML.length() < contentLen && client.available())
+		inXML += (char) client.read();
+
+	// the properties Windows sets after copying a file, FAT keeps all of them
+	static const char *names[] = { "Win32CreationTime", "Win32LastAccessTime", "Win32LastModifiedTime", "Win32FileAttributes" };
+	static const uint8_t flags[] = { T_CREATE, T_ACCESS, T_WRITE, 0 };
+	String setProps, failedProps;
+
+	for(int i = 0; i < 4; i++)	{
+		String value;
+		if(!getXmlValue(inXML, names[i], &value))
+			continue;
+
+		bool ok;
+		if(flags[i])	{
+			uint16_t year;
+			uint8_t month, day, hour, minute, second;
+			ok = parseHttpDate(value, &year, &month, &day, &hour, &minute, &second) &&
+				file.timestamp(flags[i], year, month, day, hour, minute, second);
+		}
+		else
+			// hex flags, the bits below 0x40 are the FAT attribute bits
+			ok = file.attrib(strtoul(value.c_str(), NULL, 16) & FS_ATTRIB_USER_SETTABLE);
+
+		DBG_PRINT(names[i]); DBG_PRINT(": "); DBG_PRINT(value); DBG_PRINTLN(ok ? " set" : " failed");
+		(ok ? setProps : failedProps) += String("<Z:") + names[i] + "/>";
+	}
+	file.close();
+
+	// one propstat per outcome, other properties are not stored and not listed
+	String resp = F("<?xml version=\"1.0\" encoding=\"utf-8\"?><D:multistatus xmlns:D=\"DAV:\" xmlns:Z=\"urn:schemas-microsoft-com:\"><D:response><D:href>");
+	resp += uri;
+	resp += F("</D:href>");
+	if(setProps.length())
+		resp += "<D:propstat><D:prop>" + setProps + "</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat>";
+	if(failedProps.length())
+		resp += "<D:propstat><D:prop>" + failedProps + "</D:prop><D:status>HTTP/1.1 409 Conflict</D:status></D:propstat>";
+	resp += F("</D:response></D:multistatus>");
+
+	send("207 Multi-Status", "application/xml;charset=utf-8", resp);
+}
+
+
+
+// ------------------------
+bool DavConnection::getXmlValue(const String& xml, const char *name, String *value)	{
+// ------------------------
+	// text of the first element with this local name, with or without prefix
+	String tag = String(":") + name + ">";
+	int start = xml.indexOf(tag);
+	if(start < 0)	{
+		tag = String("<") + name + ">";
+		start = xml.indexOf(tag);
+	}
+	if(start < 0)
+		return false;
+
+	start += tag.length();
+	int end = xml.indexOf("</", start);
+	if(end < 0)
+		return false;
+
+	*value = xml.substring(start, end);
+	value->trim();
+	return true;
+}
+
+
+
+// ------------------------
+bool DavConnection::parseHttpDate(const String& text, uint16_t *year, uint8_t *month, uint8_t *day, uint8_t *hour, uint8_t *minute, uint8_t *second)	{
+// ------------------------
+	// Tue, 13 Oct 2015 17:07:35 GMT, kept as is since the card's times are sent as GMT
+	char mon[4];
+	int d, y, h, m, s;
+	if(sscanf(text.c_str(), "%*[^,], %d %3s %d %d:%d:%d", &d, mon, &y, &h, &m, &s) != 6)
+		return false;
+
+	for(int i = 0; i < 12; i++)	{
+		if(!strcmp(mon, months[i]))	{
+			*year = y;
+			*month = i + 1;
+			*day = d;
+			*hour = h;
+			*minute = m;
+			*second = s;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+
+// ------------------------
+bool DavConnection::wantsWin32Props()	{
 // ------------------------
-	DBG_PRINTLN("PROPPATCH forwarding to PROPFIND");
-	handleProp(resource);
+	// the Windows redirector names them in its request body, an allprop
+	// request or one without a body gets the DAV properties only
+	size_t contentLen = contentLengthHeader.toInt();
+	if(contentLen == 0 || contentLen > HTTP_MAX_SMALL_BODY)
+		return false;
+
+	// the body is small and already received, see isBodyReady()
+	String inXML;
+	inXML.reserve(contentLen);
+	while(inXML.length() < contentLen && client.available())
+		inXML += (char) client.read();
+
+	return inXML.indexOf("Win32") >= 0 || inXML.indexOf("ishidden") >= 0;
 }
 
 
 
 // ------------------------
-void ESPWebDAV::handleProp(ResourceType resource)	{
+void DavConnection::handleProp(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing PROPFIND");
 	// check depth header
@@ -247,57 +457,138 @@ void ESPWebDAV::handleProp(ResourceType resource)	{
 	else
 		sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE");
 
+	// listings are repetitive markup, send them compressed if the client takes it
+	GzipStream *encoder = NULL;
+	if(acceptEncodingHeader.indexOf("gzip") >= 0)	{
+		encoder = new GzipStream();
+		if(encoder->begin([this](const uint8_t *data, size_t len) { sendChunk((const char *) data, len); }))
+			sendHeader("Content-Encoding", "gzip");
+		else	{
+			delete encoder;
+			encoder = NULL;
+		}
+	}
+
 	setContentLength(CONTENT_LENGTH_UNKNOWN);
 	send("207 Multi-Status", "application/xml;charset=utf-8", "");
+	gzip = encoder;
 	sendContent(F("<?xml version=\"1.0\" encoding=\"utf-8\"?>"));
-	sendContent(F("<D:multistatus xmlns:D=\"DAV:\">"));
-
-	// open this resource
-	SdFile baseFile;
-	baseFile.open(uri.c_str(), O_READ);
-	sendPropResponse(false, &baseFile);
+	sendContent(F("<D:multistatus xmlns:D=\"DAV:\" xmlns:Z=\"urn:schemas-microsoft-com:\">"));
 
 	if((resource == RESOURCE_DIR) && (depth == DEPTH_CHILD))	{
-		// append children information to message
-		SdFile childFile;
-		while(childFile.openNext(&baseFile, O_READ)) {
-			yield();
-			sendPropResponse(true, &childFile);
-			childFile.close();
+		// repeated folder views are replayed from RAM, the entry may go
+		// away while it is sent so the connection takes a copy
+		const String *cached = propCache.find(uri, win32Props);
+		if(cached)	{
+			DBG_PRINTLN("Listing from cache");
+			propBody = *cached;
+			propPos = 0;
+			propReplay = true;
+			startJob(JOB_PROPFIND, CONN_BODY_OUT, 0);
+			return;
 		}
+
+		// record what is sent for the next request
+		propGeneration = propCache.generation();
+		propBody = String();
+		propCaching = true;
+
+		// and the names for lookups in this directory
+		building = nameIndex.beginBuild(uri);
+	}
+
+	// the resource was opened by handleRequest()
+	sendPropResponse(false, &file);
+
+	if((resource == RESOURCE_DIR) && (depth == DEPTH_CHILD))	{
+		// children are appended by the job as the client takes them
+		startJob(JOB_PROPFIND, CONN_BODY_OUT, 0);
+		return;
 	}
 
-	baseFile.close();
+	file.close();
 	sendContent(F("</D:multistatus>"));
 }
 
 
 
 // ------------------------
-void ESPWebDAV::sendPropResponse(boolean recursing, FatFile *curFile)	{
+bool DavConnection::stepPropFind()	{
 // ------------------------
-	char buf[255];
-	curFile->getName(buf, sizeof(buf));
+	// an entry is a few hundred bytes, wait until the TCP buffer takes it
+	if(client.availableForWrite() < 512)	{
+		if(!client.connected())
+			abort();
+		return false;
+	}
 
-// String fullResPath = "http://" + hostHeader + uri;
-	String fullResPath = uri;
+	if(propReplay)	{
+		if(propPos < propBody.length())	{
+			// the quota is filled in as it is now
+			int mark = propBody.indexOf(PROP_QUOTA_MARK, propPos);
+			if(mark == (int) propPos)	{
+				sendQuota();
+				propPos++;
+				return true;
+			}
+
+			size_t end = mark < 0 ? propBody.length() : mark;
+			size_t n = min(end - propPos, (size_t) 512);
+			sendContent(propBody.substring(propPos, propPos + n));
+			propPos += n;
+			return true;
+		}
 
-	if(recursing)
-	{
-		if(fullResPath.endsWith("/"))
-			fullResPath += String(buf);
-		else
-			fullResPath += "/" + String(buf);
+		propReplay = false;
+		sendContent(F("</D:multistatus>"));
+		endJob();
+		return true;
 	}
-	// get file modified time
-	DirFat_t dir;
-	curFile->dirEntry(&dir);
 
+	// append children information to message
+	SdFile childFile;
+	if(!childFile.openNext(&file, O_READ))	{
+		if(propCaching)	{
+			propCaching = false;
+			propCache.store(uri, win32Props, propBody, propGeneration);
+		}
+
+		if(building)	{
+			nameIndex.commit(building);
+			building = NULL;
+		}
+
+		sendContent(F("</D:multistatus>"));
+		endJob();
+		return true;
+	}
+
+	sendPropResponse(true, &childFile);
+	childFile.close();
+	return true;
+}
+
+
+
+// ------------------------
+void DavConnection::invalidateCaches()	{
+// ------------------------
+	cardChanged(uri);
+	sidecarBuilder.drop(uri);
+	if(destinationHeader.length())	{
+		String destination = urlDecode(urlToUri(destinationHeader));
+		cardChanged(destination);
+		sidecarBuilder.drop(destination);
+	}
+}
+
+
+
+// ------------------------
+String DavConnection::httpDate(uint16_t pdate, uint16_t ptime)	{
+// ------------------------
 	// convert to required format
 	tm tmStr;
-	uint16_t pdate;
-	uint16_t ptime;
-	curFile->getModifyDateTime(&pdate, &ptime);
 	tmStr.tm_hour = FS_HOUR(ptime);
 	tmStr.tm_min = FS_MINUTE(ptime);
 	tmStr.tm_sec = FS_SECOND(ptime);
@@ -308,8 +599,47 @@ void ESPWebDAV::sendPropResponse(boolean recursing, FatFile *curFile)	{
 	tm *gTm = gmtime(&t2t);
 
 	// Tue, 13 Oct 2015 17:07:35 GMT
+	char buf[32];
 	sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT", wdays[gTm->tm_wday], gTm->tm_mday, months[gTm->tm_mon], gTm->tm_year + 1900, gTm->tm_hour, gTm->tm_min, gTm->tm_sec);
-	String fileTimeStamp = String(buf);
+	return String(buf);
+}
+
+
+
+// ------------------------
+void DavConnection::sendPropResponse(boolean recursing, FatFile *curFile)	{
+// ------------------------
+	char buf[255];
+	curFile->getName(buf, sizeof(buf));
+
+	if(recursing && building)
+		building->add(buf, curFile->dirIndex());
+
+// String fullResPath = "http://" + hostHeader + uri;
+	String fullResPath = uri;
+
+	if(recursing)
+	{
+		if(fullResPath.endsWith("/"))
+			fullResPath += String(buf);
+		else
+			fullResPath += "/" + String(buf);
+	}
+	// times and attributes all come from the directory entry, the one of
+	// the resource itself was read by handleRequest()
+	DirFat_t dir;
+	if(recursing)
+		curFile->dirEntry(&dir);
+	else
+		dir = resourceDir;
+	uint16_t createDate = dir.createDate[0] | (dir.createDate[1] << 8);
+	uint16_t createTime = dir.createTime[0] | (dir.createTime[1] << 8);
+	uint16_t accessDate = dir.accessDate[0] | (dir.accessDate[1] << 8);
+	uint16_t modifyDate = dir.modifyDate[0] | (dir.modifyDate[1] << 8);
+	uint16_t modifyTime = dir.modifyTime[0] | (dir.modifyTime[1] << 8);
+	uint8_t attributes = dir.attributes & FS_ATTRIB_COPY;
+
+	String fileTimeStamp = httpDate(modifyDate, modifyTime);
 
 
 	// send the XML information about thyself to client
@@ -323,9 +653,35 @@ void ESPWebDAV::sendPropResponse(boolean recursing, FatFile *curFile)	{
 	// append unique tag generated from full path
 	sendContent("\"" + sha1(fullResPath + fileTimeStamp) + "\"");
 	sendContent(F("</D:getetag>"));
+	// writers that don't set the creation stamp leave it zero
+	if(FS_MONTH(createDate))	{
+		// 2015-10-13T17:07:35Z
+		sprintf(buf, "<D:creationdate>%04d-%02d-%02dT%02d:%02d:%02dZ</D:creationdate>", FS_YEAR(createDate), FS_MONTH(createDate), FS_DAY(createDate), FS_HOUR(createTime), FS_MINUTE(createTime), FS_SECOND(createTime));
+		sendContent(buf);
+	}
+	// with these the Windows redirector doesn't ask again per file, they
+	// double the size of a listing so only clients asking for them get them
+	if(win32Props)	{
+		sendContent(F("<Z:Win32CreationTime>"));
+		sendContent(httpDate(createDate, createTime));
+		sendContent(F("</Z:Win32CreationTime><Z:Win32LastAccessTime>"));
+		sendContent(httpDate(accessDate, 0));
+		sendContent(F("</Z:Win32LastAccessTime><Z:Win32LastModifiedTime>"));
+		sendContent(fileTimeStamp);
+		sendContent(F("</Z:Win32LastModifiedTime><Z:Win32FileAttributes>"));
+		sprintf(buf, "%08X", attributes);
+		sendContent(buf);
+		sendContent(F("</Z:Win32FileAttributes><D:ishidden>"));
+		sendContent((attributes & FS_ATTRIB_HIDDEN) ? "1" : "0");
+		sendContent(F("</D:ishidden><D:isreadonly>"));
+		sendContent((attributes & FS_ATTRIB_READ_ONLY) ? "1" : "0");
+		sendContent(F("</D:isreadonly>"));
+	}
 
-	if(curFile->isDir())
+	if(curFile->isDir())	{
 		sendContent(F("<D:resourcetype><D:collection/></D:resourcetype>"));
+		sendQuota();
+	}
 	else	{
 		sendContent(F("<D:resourcetype/><D:getcontentlength>"));
 		// append the file size
@@ -340,9 +696,30 @@ void ESPWebDAV::sendPropResponse(boolean recursing, FatFile *curFile)	{
 
 
 
+// ------------------------
+void DavConnection::sendQuota()	{
+// ------------------------
+	// a listing being recorded keeps a mark instead of the numbers
+	bool recording = propCaching;
+	if(recording)
+		propBody += PROP_QUOTA_MARK;
+	propCaching = false;
+
+	// RFC 4331, the whole card is one quota
+	if(freeSpace.isKnown())	{
+		sendContent(F("<D:quota-available-bytes>"));
+		sendContent(String(freeSpace.freeBytes()));
+		sendContent(F("</D:quota-available-bytes><D:quota-used-bytes>"));
+		sendContent(String(freeSpace.usedBytes()));
+		sendContent(F("</D:quota-used-bytes>"));
+	}
+	propCaching = recording;
+}
+
+
 
 // ------------------------
-void ESPWebDAV::handleGet(ResourceType resource, bool isGet)	{
+void DavConnection::handleGet(ResourceType resource, bool isGet)	{
 // ------------------------
 	DBG_PRINTLN("Processing GET");
 
@@ -350,41 +727,219 @@ void ESPWebDAV::handleGet(ResourceType resource, bool isGet)	{
 	if(resource != RESOURCE_FILE)
 		return handleNotFound();
 
-	SdFile rFile;	
-	long tStart = millis();
-	uint8_t buf[1460];
-	rFile.open(uri.c_str(), O_READ);
+	// a current "name.gz" next to the file is sent instead, compressed ahead of
+	// time by the sidecar builder. Ranges always refer to the file itself.
+	bool sidecar = false;
+	String gzUri = uri + ".gz";
+	if(rangeHeader.length() == 0 && !uri.endsWith(".gz") && acceptEncodingHeader.indexOf("gzip") >= 0)	{
+		FatFile gzFile;
+		if(openPath(&gzFile, gzUri, O_READ) && SidecarBuilder::isCurrent(&file, &gzFile))	{
+			file.close();
+			sidecar = openCached(gzUri, &file, &map);
+			if(!sidecar && !openCached(uri, &file, &map))
+				return handleNotFound();
+		}
+	}
 
 	sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE,HEAD,POST,PUT,GET");
-	size_t fileSize = rFile.fileSize();
-	setContentLength(fileSize);
-	String contentType = getMimeType(uri);
-	if(uri.endsWith(".gz") && contentType != "application/x-gzip" && contentType != "application/octet-stream")
+	sendHeader("Accept-Ranges", "bytes");
+	if(sidecar)	{
+		sendHeader("Content-Encoding", "gzip");
+		sendHeader("Vary", "Accept-Encoding");
+	}
+	size_t fileSize = file.fileSize();
+
+	// a single byte range is served as 206, anything else as the whole file
+	size_t first = 0, last = fileSize - 1;
+	int8_t range = parseRange(fileSize, &first, &last);
+	if(range < 0)	{
+		sendHeader("Content-Range", "bytes */" + String(fileSize));
+		send("416 Range Not Satisfiable", NULL, "");
+		file.close();
+		return;
+	}
+
+	size_t length = fileSize ? last - first + 1 : 0;
+	if(range)
+		sendHeader("Content-Range", "bytes " + String(first) + "-" + String(last) + "/" + String(fileSize));
+
+	setContentLength(length);
+	const char *contentType = getMimeType(uri);
+	if(uri.endsWith(".gz") && strcmp(contentType, "application/x-gzip") && strcmp(contentType, "application/octet-stream"))
 		sendHeader("Content-Encoding", "gzip");
 
-	send("200 OK", contentType.c_str(), "");
+	send(range ? "206 Partial Content" : "200 OK", contentType, "");
+
+	if(!isGet || length == 0)	{
+		file.close();
+		return;
+	}
+
+	// whole sectors, so SdFat reads bypass its single sector cache
+	startJob(JOB_GET, CONN_BODY_OUT, GET_READ_BLOCKS * 512);
+	if(!buf)
+		return abort();
 
-	if(isGet)	{
-		// disable Nagle if buffer size > TCP MTU of 1460
-		// client.setNoDelay(1);
+	numRemaining = length;
+	filePos = first;
+}
 
-		// send the file
-		while(rFile.available())	{
-			// SD read speed ~ 17sec for 4.5MB file
-			int numRead = rFile.read(buf, sizeof(buf));
-			client.write(buf, numRead);
-		}
+
+
+// ------------------------
+int8_t DavConnection::parseOffset(const String& text, size_t *value)	{
+// ------------------------
+	// toInt() is a signed long, offsets past 2 GiB of a FAT32 file need all 32 bits
+	if(text.length() == 0)
+		return 0;
+	for(unsigned int i = 0; i < text.length(); i++)
+		if(!isdigit(text[i]))
+			return 0;
+
+	errno = 0;
+	unsigned long n = strtoul(text.c_str(), NULL, 10);
+	if(errno == ERANGE || n > (size_t) -1)
+		return -1;
+
+	*value = n;
+	return 1;
+}
+
+
+
+// ------------------------
+int8_t DavConnection::parseRange(size_t fileSize, size_t *first, size_t *last)	{
+// ------------------------
+	// "bytes=first-last", "bytes=first-" or "bytes=-suffix"
+	if(!rangeHeader.startsWith("bytes=") || rangeHeader.indexOf(',') >= 0)
+		return 0;
+
+	String spec = rangeHeader.substring(6);
+	spec.trim();
+	int dash = spec.indexOf('-');
+	if(dash < 0)
+		return 0;
+
+	String from = spec.substring(0, dash);
+	String to = spec.substring(dash + 1);
+	if(from.length() == 0)	{
+		// the last bytes of the file, more than size_t holds is all of it
+		size_t suffix = fileSize;
+		if(parseOffset(to, &suffix) == 0)
+			return 0;
+		if(suffix == 0 || fileSize == 0)
+			return -1;
+		*first = suffix < fileSize ? fileSize - suffix : 0;
+		*last = fileSize - 1;
+		return 1;
 	}
 
-	rFile.close();
-	DBG_PRINT("File "); DBG_PRINT(fileSize); DBG_PRINT(" bytes sent in: "); DBG_PRINT((millis() - tStart)/1000); DBG_PRINTLN(" sec");
+	int8_t ok = parseOffset(from, first);
+	if(ok <= 0)
+		return ok;
+
+	// a last byte past what size_t holds is past the end of the file as well
+	*last = fileSize - 1;
+	if(to.length() && parseOffset(to, last) == 0)
+		return 0;
+	if(*first >= fileSize || *last < *first)
+		return -1;
+
+	if(*last >= fileSize)
+		*last = fileSize - 1;
+	return 1;
 }
 
 
 
+// ------------------------
+bool DavConnection::stepGet()	{
+// ------------------------
+	if(numRemaining == 0)	{
+		DBG_PRINT("File "); DBG_PRINT(file.fileSize()); DBG_PRINT(" bytes sent in: "); DBG_PRINT(millis() - tStart); DBG_PRINTLN(" ms");
+		endJob();
+		return true;
+	}
+
+	// only read when the TCP send buffer has room
+	size_t numToSend = min(numRemaining, bufSize);
+	if((size_t) client.availableForWrite() < min(numToSend, (size_t) 512))	{
+		if(!client.connected())
+			abort();
+		return false;
+	}
+
+	// a long chain is mapped further as the download gets to its end
+	if(!map.covers(filePos) && !map.isDone())
+		map.extend(&file, FILEMAP_STEP_SECTORS);
+
+	size_t numRead = 0;
+	size_t skip = 0;
+	if(map.covers(filePos))	{
+		// the map gives the sector of any offset, gather a few per TCP write
+		uint32_t numFollowing;
+		uint32_t sector = map.sector(filePos, &numFollowing);
+		skip = filePos % 512;
+		uint32_t n = min(min((uint32_t) ((skip + numToSend + 511) / 512), numFollowing), (uint32_t) (bufSize / 512));
+
+		// a new extent needs a new multi block read, bgnBlock is where the running one is
+		if(cardReading && sector != bgnBlock)	{
+			sd->card()->readStop();
+			cardReading = false;
+		}
+
+		if(!cardReading)	{
+			if(!sd->card()->readStart(sector))	{
+				abort();
+				return false;
+			}
+			cardReading = true;
+		}
+
+		for(uint32_t i = 0; i < n; i++)	{
+			if(!sd->card()->readData(buf + i * 512))	{
+				// the response is already on its way, cut it short
+				abort();
+				return false;
+			}
+		}
+
+		bgnBlock = sector + n;
+		numRead = n * 512 - skip;
+	}
+	else	{
+		// past the map, sector aligned reads still go straight to the card
+		if(cardReading)	{
+			sd->card()->readStop();
+			cardReading = false;
+		}
+		if(file.curPosition() != filePos && !file.seekSet(filePos))	{
+			abort();
+			return false;
+		}
+		int n = file.read(buf, numToSend);
+		if(n <= 0)	{
+			abort();
+			return false;
+		}
+		numRead = n;
+	}
+
+	numToSend = min(numToSend, numRead);
+	if(client.write(buf + skip, numToSend) != numToSend)	{
+		abort();
+		return false;
+	}
+
+	filePos += numToSend;
+	numRemaining -= numToSend;
+	return true;
+}
+
+
 
 // ------------------------
-void ESPWebDAV::handlePut(ResourceType resource)	{
+void DavConnection::handlePut(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing Put");
 
@@ -392,118 +947,340 @@ void ESPWebDAV::handlePut(ResourceType resource)	{
 	if(resource == RESOURCE_DIR)
 		return handleNotFound();
 
-	SdFile nFile;
 	sendHeader("Allow", "PROPFIND,OPTIONS,DELETE,COPY,MOVE,HEAD,POST,PUT,GET");
 
-	// if file does not exist, create it
-	if(resource == RESOURCE_NONE)	{
-		if(!nFile.open(uri.c_str(), O_CREAT | O_WRITE))
-			return handleWriteError("Unable to create a new file", &nFile);
+	// did server send any data in put
+	size_t contentLen = contentLengthHeader.toInt();
+	// streaming clients (macOS Finder) send the body in chunks without a length
+	chunkedBody = transferEncodingHeader.equalsIgnoreCase("chunked");
+	rawWrite = !spooled && (chunkedBody || contentLen > PUT_RAW_THRESHOLD);
+
+	if(spooled)	{
+		// committed to the card by the spool once the printer is done
+		switch(uploadSpool.create(&spoolFile, uri, chunkedBody ? expectedLengthHeader.toInt() : contentLen))	{
+		case SPOOL_NO_FOLDER:
+			return send("409 Conflict", "text/plain", "The folder doesn't exist");
+		case SPOOL_FULL:
+			return send("507 Insufficient Storage", "text/plain", "No room to spool the upload");
+		default:
+			break;
+		}
+	}
+	else if(!rawWrite)	{
+		// small files go through the ordinary file API, this also
+		// truncates an existing file on an empty body
+		if(!file.open(uri.c_str(), O_CREAT | O_WRITE | O_TRUNC))
+			return handleWriteError("Unable to create a new file", &file);
+	}
+	else	{
+		// high speed raw write implementation
+		// delete old file
+		sd->remove(uri.c_str());
+
+		// use the size hint of a chunked upload if the client sent one
+		extent = chunkedBody ? expectedLengthHeader.toInt() : contentLen;
+		if(extent == 0)
+			extent = PUT_CHUNKED_EXTENT;
+
+		// create a contiguous file, shrink a guessed extent if the card is full
+		while(!file.createContiguous(uri.c_str(), (extent/512 + 1) * 512))	{
+			extent /= 2;
+			if(!chunkedBody || extent < PUT_CHUNKED_MIN_EXTENT)
+				return handleWriteError("File create contiguous sections failed", &file);
+		}
+
+		// get the location of the file's blocks
+		if (!file.contiguousRange(&bgnBlock, &endBlock))
+			return handleWriteError("Unable to get contiguous range", &file);
 	}
 
 	// file is created/open for writing at this point
 	DBG_PRINT(uri); DBG_PRINTLN(" - ready for data");
-	// did server send any data in put
-	size_t contentLen = contentLengthHeader.toInt();
 
-	if(contentLen != 0)	{
-		// buffer size is critical *don't change*
-		const size_t WRITE_BLOCK_CONST = 512;
-		uint8_t buf[WRITE_BLOCK_CONST];
-		long tStart = millis();
-		size_t numRemaining = contentLen;
+	// the job stores the body as it arrives
+	startJob(JOB_PUT, CONN_BODY_IN, 512);
+	if(!buf)	{
+		putError("Out of memory");
+		return;
+	}
 
-		// high speed raw write implementation
-		// close any previous file
-		nFile.close();
-		// delete old file
-		sd.remove(uri.c_str());
-	
-		// create a contiguous file
-		size_t contBlocks = (contentLen/WRITE_BLOCK_CONST + 1);
-		uint32_t bgnBlock, endBlock;
+	numRemaining = contentLen;
+	numReceived = 0;
+	numBlocks = 0;
+	fill = 0;
+	bodyDone = !chunkedBody && contentLen == 0;
+	bodyError = false;
+	chunkState = CHUNK_SIZE;
+	lineBuf = "";
+}
 
-		if (!nFile.createContiguous(uri.c_str(), contBlocks * WRITE_BLOCK_CONST))
-			return handleWriteError("File create contiguous sections failed", &nFile);
 
-		// get the location of the file's blocks
-		if (!nFile.contiguousRange(&bgnBlock, &endBlock))
-			return handleWriteError("Unable to get contiguous range", &nFile);
 
-		if (!sd.card()->writeStart(bgnBlock, contBlocks))
-			return handleWriteError("Unable to start writing contiguous range", &nFile);
+// ------------------------
+bool DavConnection::stepPut()	{
+// ------------------------
+	// collect a block, raw writes need whole sectors
+	size_t numRead = 0;
+	while(!bodyDone && !bodyError && fill < 512)	{
+		size_t n = readBody(buf + fill, 512 - fill);
+		if(n == 0)
+			break;
+
+		fill += n;
+		numRead += n;
+		numReceived += n;
+	}
 
-		// read data from stream and write to the file
-		while(numRemaining > 0)	{
-			size_t numToRead = (numRemaining > WRITE_BLOCK_CONST) ? WRITE_BLOCK_CONST : numRemaining;
-			size_t numRead = readBytesWithTimeout(buf, sizeof(buf), numToRead);
-			if(numRead == 0)
-				break;
+	if(bodyError)
+		return putError("Invalid chunk header");
 
-			// store whole buffer into file regardless of numRead
-			if (!sd.card()->writeData(buf))
-				return handleWriteError("Write data failed", &nFile);
+	if(!bodyDone && fill < 512)	{
+		// wait for more data
+		if(!client.connected() && !client.available())
+			return putError("Timed out waiting for data");
+		return numRead > 0;
+	}
 
-			// reduce the number outstanding
-			numRemaining -= numRead;
+	if(fill > 0)	{
+		if(spooled)	{
+			if(spoolFile.write(buf, fill) != fill)
+				return putError("Spool full");
+		}
+		else if(!rawWrite)	{
+			if(file.write(buf, fill) != fill)
+				return putError("Write data failed");
+		}
+		else	{
+			// a chunked body outgrew the extent
+			if(bgnBlock + numBlocks > endBlock)	{
+				endCardTransfer();
+				extent *= 2;
+				if(!growContiguous((extent/512 + 1) * 512))
+					return putError("Unable to grow contiguous range");
+			}
+
+			if(!cardWriting)	{
+				if(!sd->card()->writeStart(bgnBlock + numBlocks))
+					return putError("Unable to start writing contiguous range");
+				cardWriting = true;
+			}
+
+			// store whole buffer into file regardless of fill
+			cardVolume.cache().invalidate(bgnBlock + numBlocks, 1);
+			if (!sd->card()->writeData(buf))
+				return putError("Write data failed");
+
+			numBlocks++;
 		}
 
-		// stop writing operation
-		if (!sd.card()->writeStop())
-			return handleWriteError("Unable to stop writing contiguous range", &nFile);
-
-		// detect timeout condition
-		if(numRemaining)
-			return handleWriteError("Timed out waiting for data", &nFile);
+		fill = 0;
+		return true;
+	}
 
-		// truncate the file to right length
-		if(!nFile.truncate(contentLen))
-			return handleWriteError("Unable to truncate the file", &nFile);
+	// stop writing operation
+	if(cardWriting)	{
+		cardWriting = false;
+		if (!sd->card()->writeStop())
+			return putError("Unable to stop writing contiguous range");
+	}
 
-		DBG_PRINT("File "); DBG_PRINT(contentLen - numRemaining); DBG_PRINT(" bytes stored in: "); DBG_PRINT((millis() - tStart)/1000); DBG_PRINTLN(" sec");
+	if(spooled)	{
+		if(!uploadSpool.finish(&spoolFile))
+			return putError("Unable to spool the file");
+		DBG_PRINT("File "); DBG_PRINT(numReceived); DBG_PRINT(" bytes spooled in: "); DBG_PRINT(millis() - tStart); DBG_PRINTLN(" ms");
+		send("202 Accepted", NULL, "");
+		endJob();
+		return true;
 	}
 
+	// truncate the file to right length, this frees the unused extent
+	if(rawWrite && !file.truncate(numReceived))
+		return putError("Unable to truncate the file");
+
+	freeSpace.resized(resourceSize, numReceived);
+	changeJournal.record(CHANGE_WRITTEN, uri);
+
+	DBG_PRINT("File "); DBG_PRINT(numReceived); DBG_PRINT(rawWrite ? " bytes stored raw in: " : " bytes stored buffered in: "); DBG_PRINT(millis() - tStart); DBG_PRINTLN(" ms");
+
 	if(resource == RESOURCE_NONE)
 		send("201 Created", NULL, "");
 	else
 		send("200 OK", NULL, "");
 
-	nFile.close();
+	endJob();
+	return true;
 }
 
 
 
-
 // ------------------------
-void ESPWebDAV::handleWriteError(String message, FatFile *wFile)	{
+bool DavConnection::stepDrain()	{
 // ------------------------
-	// close this file
-	wFile->close();
-	// delete the wrile being written
-	sd.remove(uri.c_str());
-	// send error
-	send("500 Internal Server Error", "text/plain", message);
-	DBG_PRINTLN(message);
+	if(readBody(buf, bufSize) > 0)
+		return true;
+
+	if(bodyDone || !client.connected())	{
+		endJob();
+		return true;
+	}
+	return false;
 }
 
 
+
 // ------------------------
-void ESPWebDAV::handleDirectoryCreate(ResourceType resource)	{
+size_t DavConnection::readBody(uint8_t *dst, size_t maxLen)	{
 // ------------------------
-	DBG_PRINTLN("Processing MKCOL");
-	
-	// does URI refer to anything
+	if(!chunkedBody)	{
+		size_t numToRead = min(min(maxLen, numRemaining), (size_t) client.available());
+		size_t numRead = numToRead ? client.read(dst, numToRead) : 0;
+		numRemaining -= numRead;
+		bodyDone = numRemaining == 0;
+		return numRead;
+	}
+
+	// decode "size CRLF data CRLF ... 0 CRLF trailers CRLF" without waiting
+	while(client.available())	{
+		if(chunkState == CHUNK_DATA)	{
+			size_t numToRead = min(min(maxLen, chunkRemaining), (size_t) client.available());
+			size_t numRead = client.read(dst, numToRead);
+			chunkRemaining -= numRead;
+			if(chunkRemaining == 0)
+				chunkState = CHUNK_DATA_END;
+			return numRead;
+		}
+
+		char c = client.read();
+		if(c != '\n')	{
+			if(c != '\r' && lineBuf.length() < HTTP_MAX_LINE)
+				lineBuf += c;
+			continue;
+		}
+
+		if(chunkState == CHUNK_SIZE)	{
+			if(!parseChunkSize(lineBuf, &chunkRemaining))	{
+				bodyError = true;
+				return 0;
+			}
+			chunkState = chunkRemaining ? CHUNK_DATA : CHUNK_TRAILER;
+		}
+		else if(chunkState == CHUNK_DATA_END)
+			chunkState = CHUNK_SIZE;
+		else if(lineBuf.length() == 0)	{
+			// empty line after the last chunk and its trailers
+			bodyDone = true;
+			return 0;
+		}
+
+		lineBuf = "";
+	}
+
+	return 0;
+}
+
+
+
+// ------------------------
+bool DavConnection::growContiguous(size_t newSize)	{
+// ------------------------
+	// SdFat can only preallocate empty files, so the bigger extent is a new
+	// contiguous file which takes over the blocks written so far
+	uint8_t copyBuf[512];
+	String tmpUri = uri + "~";
+	SdFile tFile;
+	uint32_t tBgnBlock, tEndBlock;
+
+	DBG_PRINT("Growing upload extent to "); DBG_PRINTLN(newSize);
+
+	sd->remove(tmpUri.c_str());
+	if (!tFile.createContiguous(tmpUri.c_str(), newSize))
+		return false;
+
+	if (!tFile.contiguousRange(&tBgnBlock, &tEndBlock))	{
+		tFile.remove();
+		return false;
+	}
+
+	// copy the blocks written so far card to card
+	for(uint32_t i = 0; i < numBlocks; i++)	{
+		cardVolume.cache().invalidate(tBgnBlock + i, 1);
+		if (!sd->card()->readSector(bgnBlock + i, copyBuf) || !sd->card()->writeSector(tBgnBlock + i, copyBuf))	{
+			tFile.remove();
+			return false;
+		}
+
+		if((i & 63) == 0)
+			yield();
+	}
+
+	// replace the old extent with the new one
+	tFile.close();
+	file.close();
+	if (!sd->remove(uri.c_str()) || !sd->rename(tmpUri.c_str(), uri.c_str()))	{
+		sd->remove(tmpUri.c_str());
+		return false;
+	}
+
+	if (!file.open(uri.c_str(), O_RDWR))
+		return false;
+
+	bgnBlock = tBgnBlock;
+	endBlock = tEndBlock;
+	return true;
+}
+
+
+
+// ------------------------
+bool DavConnection::putError(const char *message)	{
+// ------------------------
+	endCardTransfer();
+	if(spooled)	{
+		uploadSpool.discard(&spoolFile);
+		send("500 Internal Server Error", "text/plain", message);
+	}
+	else
+		handleWriteError(message, &file);
+	endJob();
+	return false;
+}
+
+
+
+// ------------------------
+void DavConnection::handleWriteError(String message, FatFile *wFile)	{
+// ------------------------
+	// close this file
+	wFile->close();
+	// delete the wrile being written
+	sd->remove(uri.c_str());
+	// the old file is gone as well
+	freeSpace.resized(resourceSize, 0);
+	// send error
+	send("500 Internal Server Error", "text/plain", message);
+	DBG_PRINTLN(message);
+}
+
+
+// ------------------------
+void DavConnection::handleDirectoryCreate(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing MKCOL");
+	
+	// does URI refer to anything
 	if(resource != RESOURCE_NONE)
 		return handleNotFound();
 	
 	// create directory
-	if (!sd.mkdir(uri.c_str(), true)) {
+	if (!sd->mkdir(uri.c_str(), true)) {
 		// send error
 		send("500 Internal Server Error", "text/plain", "Unable to create directory");
 		DBG_PRINTLN("Unable to create directory");
 		return;
 	}
 
+	freeSpace.dirCreated();
+	changeJournal.record(CHANGE_CREATED, uri);
 	DBG_PRINT(uri);	DBG_PRINTLN(" directory created");
 	sendHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
 	send("201 Created", NULL, "");
@@ -512,7 +1289,7 @@ void ESPWebDAV::handleDirectoryCreate(ResourceType resource)	{
 
 
 // ------------------------
-void ESPWebDAV::handleMove(ResourceType resource)	{
+void DavConnection::handleMove(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing MOVE");
 	
@@ -528,13 +1305,14 @@ void ESPWebDAV::handleMove(ResourceType resource)	{
 	DBG_PRINT("Move destination: "); DBG_PRINTLN(dest);
 
 	// move file or directory
-	if ( !sd.rename(uri.c_str(), dest.c_str())	) {
+	if ( !sd->rename(uri.c_str(), dest.c_str())	) {
 		// send error
 		send("500 Internal Server Error", "text/plain", "Unable to move");
 		DBG_PRINTLN("Unable to move file/directory");
 		return;
 	}
 
+	changeJournal.record(CHANGE_MOVED, uri, dest);
 	DBG_PRINTLN("Move successful");
 	sendHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
 	send("201 Created", NULL, "");
@@ -544,7 +1322,304 @@ void ESPWebDAV::handleMove(ResourceType resource)	{
 
 
 // ------------------------
-void ESPWebDAV::handleDelete(ResourceType resource)	{
+void DavConnection::handleCopy(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing COPY");
+
+	// does URI refer to anything
+	if(resource == RESOURCE_NONE)
+		return handleNotFound();
+
+	if(destinationHeader.length() == 0)
+		return handleNotFound();
+
+	if(uri.length() > 1 && uri.endsWith("/"))
+		uri.remove(uri.length() - 1);
+
+	target = urlDecode(urlToUri(destinationHeader));
+	if(target.length() > 1 && target.endsWith("/"))
+		target.remove(target.length() - 1);
+
+	DBG_PRINT("Copy destination: "); DBG_PRINTLN(target);
+
+	// a collection can't be copied onto or into itself, everything is inside the root
+	if(uri == "/" || target == uri || target.startsWith(uri + "/"))	{
+		send("403 Forbidden", "text/plain", "Destination is inside the source");
+		return;
+	}
+
+	// the parent of the destination has to exist
+	String destParent = target.substring(0, target.lastIndexOf('/'));
+	if(destParent.length() && !sd->exists(destParent.c_str()))	{
+		send("409 Conflict", "text/plain", "Destination parent does not exist");
+		return;
+	}
+
+	// overwriting is allowed unless the client says "F"
+	targetExisted = sd->exists(target.c_str());
+	if(targetExisted)	{
+		if(overwriteHeader.equalsIgnoreCase("F"))	{
+			send("412 Precondition Failed", NULL, "");
+			return;
+		}
+
+		FatFile tFile;
+		bool isDir = tFile.open(target.c_str(), O_READ) && tFile.isDir();
+		uint32_t targetSize = tFile.isOpen() ? tFile.fileSize() : 0;
+		tFile.close();
+
+		// replacing the root would empty the whole card
+		if(isDir && target.length() <= 1)	{
+			send("403 Forbidden", "text/plain", "The root can't be replaced");
+			return;
+		}
+
+		if(isDir)	{
+			// an old collection is removed by a job first, the copy follows
+			walker = new TreeWalker();
+			if(walker->begin(target))	{
+				copyAfterDelete = true;
+				startJob(JOB_DELETE, CONN_BODY_OUT, 0);
+				return;
+			}
+			delete walker;
+			walker = NULL;
+		}
+		else if(sd->remove(target.c_str()))	{
+			freeSpace.resized(targetSize, 0);
+			return startCopy();
+		}
+
+		send("500 Internal Server Error", "text/plain", "Unable to replace destination");
+		DBG_PRINTLN("Unable to replace copy destination");
+		return;
+	}
+
+	startCopy();
+}
+
+
+
+// ------------------------
+void DavConnection::startCopy()	{
+// ------------------------
+	if(resource == RESOURCE_FILE)	{
+		startJob(JOB_COPY, CONN_BODY_OUT, COPY_BLOCKS * 512);
+		if(!buf || !beginCopyFile(uri, target))	{
+			endJob();
+			send("500 Internal Server Error", "text/plain", "Unable to copy");
+			DBG_PRINTLN("Unable to copy file");
+		}
+		return;
+	}
+
+	if(!sd->mkdir(target.c_str(), false))	{
+		send("500 Internal Server Error", "text/plain", "Unable to create directory");
+		DBG_PRINTLN("Unable to create directory");
+		return;
+	}
+	freeSpace.dirCreated();
+
+	// Depth: 0 copies the collection without its members
+	if(depthHeader.equals("0"))
+		return completeCopy();
+
+	// members are copied by the job, one directory step or a few blocks at a time
+	walker = new TreeWalker();
+	walker->begin(uri);
+	startJob(JOB_COPY, CONN_BODY_OUT, COPY_BLOCKS * 512);
+	if(!buf)	{
+		endJob();
+		send("500 Internal Server Error", "text/plain", "Out of memory");
+	}
+}
+
+
+
+// ------------------------
+bool DavConnection::stepCopy()	{
+// ------------------------
+	// a file is being copied
+	if(dFile.isOpen())	{
+		stepCopyFile();
+		return true;
+	}
+
+	// a single file or the whole walk is done
+	if(!walker || !walker->next())	{
+		completeCopy();
+		return true;
+	}
+
+	String dst = target + walker->relativePath();
+	bool ok = true;
+
+	switch(walker->entry())	{
+	case WALK_FILE:
+		ok = beginCopyFile(walker->path(), dst);
+		break;
+	case WALK_DIR_ENTER:
+		ok = sd->mkdir(dst.c_str(), false);
+		if(ok)
+			freeSpace.dirCreated();
+		break;
+	case WALK_DIR_TOO_DEEP:
+		ok = false;
+		break;
+	case WALK_DIR_LEAVE:
+		break;
+	}
+
+	if(!ok)
+		addFailure(dst, "500 Internal Server Error");
+	return true;
+}
+
+
+
+// ------------------------
+bool DavConnection::beginCopyFile(const String& src, const String& dst)	{
+// ------------------------
+	uint32_t sEndBlock;
+
+	if(!file.open(src.c_str(), O_READ))
+		return false;
+
+	size_t fileSize = file.fileSize();
+	sd->remove(dst.c_str());
+
+	if(fileSize == 0)	{
+		bool ok = dFile.open(dst.c_str(), O_CREAT | O_WRITE);
+		dFile.close();
+		file.close();
+		return ok;
+	}
+
+	// the copy is preallocated contiguous, so it's written raw like a PUT
+	if(!dFile.createContiguous(dst.c_str(), fileSize))	{
+		file.close();
+		return false;
+	}
+
+	if(!dFile.contiguousRange(&bgnBlock, &endBlock))	{
+		dFile.remove();
+		file.close();
+		return false;
+	}
+	freeSpace.resized(0, fileSize);
+
+	contiguous = file.contiguousRange(&srcBlock, &sEndBlock);
+	numBlocks = (fileSize + 511) / 512;
+	blockPos = 0;
+	copyTarget = dst;
+	return true;
+}
+
+
+
+// ------------------------
+void DavConnection::stepCopyFile()	{
+// ------------------------
+	uint32_t n = min((uint32_t) COPY_BLOCKS, numBlocks - blockPos);
+	bool ok;
+
+	// read and write multi block runs, sector aligned reads for fragmented sources
+	if(contiguous)
+		ok = sd->card()->readSectors(srcBlock + blockPos, buf, n);
+	else
+		ok = file.read(buf, n * 512) > 0;
+
+	cardVolume.cache().invalidate(bgnBlock + blockPos, n);
+	ok = ok && sd->card()->writeSectors(bgnBlock + blockPos, buf, n);
+	blockPos += n;
+
+	if(!ok)	{
+		freeSpace.resized(dFile.fileSize(), 0);
+		dFile.remove();
+		file.close();
+		addFailure(copyTarget, "500 Internal Server Error");
+		return;
+	}
+
+	if(blockPos < numBlocks)
+		return;
+
+	// keep the modification time of the source
+	uint16_t pdate, ptime;
+	if(file.getModifyDateTime(&pdate, &ptime))
+		dFile.timestamp(T_WRITE, FS_YEAR(pdate), FS_MONTH(pdate), FS_DAY(pdate), FS_HOUR(ptime), FS_MINUTE(ptime), FS_SECOND(ptime));
+
+	file.close();
+	dFile.close();
+}
+
+
+
+// ------------------------
+void DavConnection::completeCopy()	{
+// ------------------------
+	endJob();
+	changeJournal.record(resource == RESOURCE_DIR ? CHANGE_CREATED : CHANGE_WRITTEN, target);
+
+	if(numFailures)	{
+		if(resource == RESOURCE_DIR)
+			return sendFailures("Copy failed");
+
+		send("500 Internal Server Error", "text/plain", "Unable to copy");
+		DBG_PRINTLN("Unable to copy file");
+		return;
+	}
+
+	DBG_PRINTLN("Copy successful");
+	sendHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
+	if(targetExisted)
+		send("204 No Content", NULL, "");
+	else
+		send("201 Created", NULL, "");
+}
+
+
+
+// ------------------------
+void DavConnection::addFailure(const String& href, const char *status)	{
+// ------------------------
+	if(numFailures++ >= DAV_MAX_REPORTED_FAILURES)
+		return;
+
+	failures += F("<D:response><D:href>");
+	failures += href;
+	failures += F("</D:href><D:status>HTTP/1.1 ");
+	failures += status;
+	failures += F("</D:status></D:response>");
+}
+
+
+
+// ------------------------
+void DavConnection::sendFailures(const char *message)	{
+// ------------------------
+	DBG_PRINT(message); DBG_PRINT(": "); DBG_PRINT(numFailures); DBG_PRINTLN(" members failed");
+
+	// only the members that failed are reported
+	setContentLength(CONTENT_LENGTH_UNKNOWN);
+	send("207 Multi-Status", "application/xml;charset=utf-8", "");
+	sendContent(F("<?xml version=\"1.0\" encoding=\"utf-8\"?>"));
+	sendContent(F("<D:multistatus xmlns:D=\"DAV:\">"));
+	sendContent(failures);
+	if(numFailures > DAV_MAX_REPORTED_FAILURES)	{
+		sendContent(F("<D:responsedescription>"));
+		sendContent(String(numFailures - DAV_MAX_REPORTED_FAILURES));
+		sendContent(F(" more members failed</D:responsedescription>"));
+	}
+	sendContent(F("</D:multistatus>"));
+
+	failures = String();
+}
+
+
+
+// ------------------------
+void DavConnection::handleDelete(ResourceType resource)	{
 // ------------------------
 	DBG_PRINTLN("Processing DELETE");
 	
@@ -552,23 +1627,341 @@ void ESPWebDAV::handleDelete(ResourceType resource)	{
 	if(resource == RESOURCE_NONE)
 		return handleNotFound();
 
-	bool retVal;
-	
-	if(resource == RESOURCE_FILE)
-		// delete a file
-		retVal = sd.remove(uri.c_str());
-	else
-		// delete a directory
-		retVal = sd.rmdir(uri.c_str());
-		
-	if(!retVal)	{
-		// send error
+	// the walk would empty the whole card before rmdir("/") fails
+	if(resource == RESOURCE_DIR && uri.length() <= 1)	{
+		send("403 Forbidden", "text/plain", "The root can't be deleted");
+		return;
+	}
+
+	if(resource == RESOURCE_DIR)	{
+		// delete a directory with everything in it, one entry per step
+		walker = new TreeWalker();
+		if(walker->begin(uri))	{
+			target = uri;
+			copyAfterDelete = false;
+			startJob(JOB_DELETE, CONN_BODY_OUT, 0);
+			return;
+		}
+		delete walker;
+		walker = NULL;
+	}
+	// delete a file
+	else if(sd->remove(uri.c_str()))	{
+		freeSpace.resized(resourceSize, 0);
+		changeJournal.record(CHANGE_DELETED, uri);
+		DBG_PRINTLN("Delete successful");
+		sendHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
+		send("200 OK", NULL, "");
+		return;
+	}
+
+	// send error
+	send("500 Internal Server Error", "text/plain", "Unable to delete");
+	DBG_PRINTLN("Unable to delete file/directory");
+}
+
+
+
+// ------------------------
+bool DavConnection::stepDelete()	{
+// ------------------------
+	// children first, a directory is removed once the walk leaves it
+	if(walker->next())	{
+		if(walker->entry() == WALK_DIR_ENTER)
+			return true;
+
+		if(!walker->remove())
+			addFailure(walker->path(), "500 Internal Server Error");
+		else if(walker->entry() == WALK_FILE)
+			freeSpace.resized(walker->size(), 0);
+		else
+			freeSpace.dirRemoved();
+		return true;
+	}
+
+	// the collection itself can't go while members are left
+	bool removed = !numFailures && sd->rmdir(target.c_str());
+	if(removed)
+		freeSpace.dirRemoved();
+	if(numFailures)
+		addFailure(target, "424 Failed Dependency");
+	endJob();
+
+	if(numFailures)	{
+		sendFailures(copyAfterDelete ? "Unable to replace destination" : "Delete failed");
+		return true;
+	}
+
+	if(!removed)	{
 		send("500 Internal Server Error", "text/plain", "Unable to delete");
 		DBG_PRINTLN("Unable to delete file/directory");
-		return;
+		return true;
+	}
+	changeJournal.record(CHANGE_DELETED, target);
+
+	// COPY replacing a collection goes on with the copy itself
+	if(copyAfterDelete)	{
+		copyAfterDelete = false;
+		startCopy();
+		return true;
 	}
 
 	DBG_PRINTLN("Delete successful");
 	sendHeader("Allow", "OPTIONS,MKCOL,LOCK,POST,PUT");
 	send("200 OK", NULL, "");
+	return true;
+}
+
+
+
+// ------------------------
+void DavConnection::handleCompress(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing POST ?compress");
+
+	if(resource != RESOURCE_DIR)
+		return handleNotFound();
+
+	// the work is done in loop() while no client uses the card
+	if(!sidecarBuilder.start(uri))	{
+		send("409 Conflict", "text/plain", "Sidecars are being built already");
+		return;
+	}
+
+	send("202 Accepted", "text/plain", "Building gzip sidecars");
+}
+
+
+
+// ------------------------
+void DavConnection::handleDefrag(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing POST ?defrag");
+
+	if(resource != RESOURCE_DIR)
+		return handleNotFound();
+
+	// the work is done in loop() while no client uses the card
+	if(!defragmenter.start(uri))	{
+		send("409 Conflict", "text/plain", "Files are being defragmented already");
+		return;
+	}
+
+	send("202 Accepted", "text/plain", "Defragmenting files");
+}
+
+
+
+// ------------------------
+void DavConnection::handleExtract(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing ?extract");
+
+	if(resource != RESOURCE_DIR)
+		return handleNotFound();
+
+	// the body is unpacked block by block as it arrives, like a PUT
+	size_t contentLen = contentLengthHeader.toInt();
+	chunkedBody = transferEncodingHeader.equalsIgnoreCase("chunked");
+
+	startJob(JOB_EXTRACT, CONN_BODY_IN, 512);
+	if(!buf)	{
+		endJob();
+		send("500 Internal Server Error", "text/plain", "Out of memory");
+		return;
+	}
+
+	extractor = new TarExtractor();
+	extractor->begin(sd, uri);
+
+	numRemaining = contentLen;
+	numReceived = 0;
+	fill = 0;
+	bodyDone = !chunkedBody && contentLen == 0;
+	bodyError = false;
+	chunkState = CHUNK_SIZE;
+	lineBuf = "";
+}
+
+
+
+// ------------------------
+bool DavConnection::stepExtract()	{
+// ------------------------
+	// collect a block, tar is made of them
+	size_t numRead = 0;
+	while(!bodyDone && !bodyError && fill < 512)	{
+		size_t n = readBody(buf + fill, 512 - fill);
+		if(n == 0)
+			break;
+
+		fill += n;
+		numRead += n;
+		numReceived += n;
+	}
+
+	if(bodyError)
+		return extractError("400 Bad Request", "Invalid chunk header");
+
+	if(!bodyDone && fill < 512)	{
+		// wait for more data
+		if(!client.connected() && !client.available())
+			return extractError("400 Bad Request", "Timed out waiting for data");
+		return numRead > 0;
+	}
+
+	if(fill == 512)	{
+		fill = 0;
+		switch(extractor->block(buf))	{
+		case TAR_ENTRY_FAILED:
+			addFailure(extractor->failedPath(), "500 Internal Server Error");
+			break;
+		case TAR_INVALID:
+			return extractError("415 Unsupported Media Type", extractor->failedPath());
+		default:
+			break;
+		}
+		return true;
+	}
+
+	// the body is complete, a file cut short is removed
+	if(extractor->finish() == TAR_ENTRY_FAILED)
+		addFailure(extractor->failedPath(), "400 Bad Request");
+
+	uint16_t numFiles = extractor->numFiles();
+	DBG_PRINT("Extracted "); DBG_PRINT(numFiles); DBG_PRINT(" files, "); DBG_PRINT(numReceived); DBG_PRINT(" bytes in "); DBG_PRINT(millis() - tStart); DBG_PRINTLN(" ms");
+	endJob();
+
+	if(numFailures)	{
+		sendFailures("Extract failed");
+		return true;
+	}
+
+	send("201 Created", "text/plain", String(numFiles) + " files extracted");
+	return true;
+}
+
+
+
+// ------------------------
+bool DavConnection::extractError(const char *code, const String& message)	{
+// ------------------------
+	extractor->abort();
+	endJob();
+	send(code, "text/plain", message);
+	DBG_PRINTLN(message);
+	return false;
+}
+
+
+
+// ------------------------
+void DavConnection::handleArchive(ResourceType resource)	{
+// ------------------------
+	DBG_PRINTLN("Processing ?archive");
+
+	if(resource != RESOURCE_DIR)
+		return handleNotFound();
+
+	ArchiveFormat format;
+	if(query.equals("archive=tar"))
+		format = ARCHIVE_TAR;
+	else if(query.equals("archive=zip"))
+		format = ARCHIVE_ZIP;
+	else	{
+		send("400 Bad Request", "text/plain", "Archive format must be tar or zip");
+		return;
+	}
+
+	// the walk opens the directory itself
+	file.close();
+	archive = new ArchiveWriter();
+	if(!archive->begin(uri, format))	{
+		delete archive;
+		archive = NULL;
+		send("500 Internal Server Error", "text/plain", "Unable to create the archive");
+		return;
+	}
+
+	String name = uri;
+	while(name.endsWith("/"))
+		name.remove(name.length() - 1);
+	name = name.substring(name.lastIndexOf('/') + 1);
+	if(name.length() == 0)
+		name = "card";
+	name += format == ARCHIVE_TAR ? ".tar" : ".zip";
+
+	// the size is known only at the end, so the archive is sent in chunks
+	sendHeader("Content-Disposition", "attachment; filename=\"" + name + "\"");
+	setContentLength(CONTENT_LENGTH_UNKNOWN);
+	send("200 OK", format == ARCHIVE_TAR ? "application/x-tar" : "application/zip", "");
+
+	startJob(JOB_ARCHIVE, CONN_BODY_OUT, ARCHIVE_CHUNK);
+	if(!buf)
+		abort();
+}
+
+
+
+// ------------------------
+bool DavConnection::stepArchive()	{
+// ------------------------
+	// only produce when the TCP send buffer takes a whole chunk
+	if((size_t) client.availableForWrite() < bufSize)	{
+		if(!client.connected())
+			abort();
+		return false;
+	}
+
+	size_t n = archive->read(buf, bufSize);
+	if(n)	{
+		sendChunk((const char *) buf, n);
+		return true;
+	}
+
+	// members that couldn't be archived are listed in the archive itself
+	DBG_PRINT("Archive of "); DBG_PRINT(archive->numEntries()); DBG_PRINT(" members sent in "); DBG_PRINT(millis() - tStart); DBG_PRINT(" ms, failed: "); DBG_PRINTLN(archive->numFailed());
+	endJob();
+	return true;
+}
+
+
+
+// ------------------------
+void DavConnection::handleChanges()	{
+// ------------------------
+	DBG_PRINTLN("Processing ?changes");
+
+	// without news the request is held, at most until shortly before the
+	// client gives up; the card isn't touched at all, a path that doesn't
+	// exist just never reports a change
+	changesSince = strtoul(query.c_str() + 8, NULL, 10);
+	if(!changeJournal.hasChanges(changesSince, uri) && numWaiting < WEBDAV_MAX_CONNECTIONS - 1)	{
+		numWaiting++;
+		startJob(JOB_CHANGES, CONN_BODY_OUT, 0);
+		return;
+	}
+
+	sendHeader("Cache-Control", "no-cache");
+	send("200 OK", "application/json", changeJournal.report(changesSince, uri));
+}
+
+
+
+// ------------------------
+bool DavConnection::stepChanges()	{
+// ------------------------
+	if(!changeJournal.hasChanges(changesSince, uri) && millis() - tStart < CHANGES_MAX_WAIT)	{
+		// waiting is no lack of progress
+		if(!client.connected())
+			abort();
+		else
+			lastActivity = millis();
+		return false;
+	}
+
+	endJob();
+	sendHeader("Cache-Control", "no-cache");
+	send("200 OK", "application/json", changeJournal.report(changesSince, uri));
+	return true;
 }
@@ -3,6 +3,18 @@
 
 #include <ESP8266WiFi.h>
 #include <SdFat.h>
+#include "TreeWalker.h"
+#include "CardCache.h"
+#include "GzipStream.h"
+#include "SidecarBuilder.h"
+#include "Defragmenter.h"
+#include "FreeSpace.h"
+#include "TarExtractor.h"
+#include "ArchiveWriter.h"
+#include "ChangeJournal.h"
+#include "CardVolume.h"
+#include "UploadSpool.h"
+#include "DavLookup.h"
 
 // debugging
 // #define DBG_PRINT(...) 		{ Serial.print(__VA_ARGS__); }
@@ -14,25 +26,83 @@
 // constants for WebServer
 #define CONTENT_LENGTH_UNKNOWN ((size_t) -1)
 #define CONTENT_LENGTH_NOT_SET ((size_t) -2)
-#define HTTP_MAX_POST_WAIT 		5000 
+#define HTTP_MAX_POST_WAIT 		5000
+// longest request or header line kept
+#define HTTP_MAX_LINE			1024
+// request bodies up to this size are received before the handler runs
+#define HTTP_MAX_SMALL_BODY		1024
+
+// connections served at the same time, each is advanced a slice per loop()
+#define WEBDAV_MAX_CONNECTIONS	3
+// a connection without any progress for this long is dropped
+#define WEBDAV_CONN_TIMEOUT		10000
+// time one connection may use per slice
+#define WEBDAV_SLICE_MS			20
+
+// initial preallocation for chunked uploads without a length hint,
+// the extent is halved on a full card and doubled when it overflows
+#define PUT_CHUNKED_EXTENT		(64UL * 1024 * 1024)
+#define PUT_CHUNKED_MIN_EXTENT	(1UL * 1024 * 1024)
+
+// bodies up to this size are written through the ordinary file API. On a
+// card in use a contiguous extent of more than a cluster is only found by a
+// FAT scan past every hole, bench/put_threshold_bench.cpp finds raw writes
+// slower up to 512 KB and faster from 1 MB
+#define PUT_RAW_THRESHOLD		(512UL * 1024)
+
+// sectors read per TCP write in GET
+#define GET_READ_BLOCKS			4
+
+// archive bytes produced per chunk of a collection download
+#define ARCHIVE_CHUNK			1024
+
+// stands for a folder's quota in a cached PROPFIND listing, the numbers
+// change with every write anywhere on the card; not a valid XML character
+#define PROP_QUOTA_MARK			'\x01'
+
+// longest time a change request waits for something to happen
+#define CHANGES_MAX_WAIT		25000
+
+// sectors moved per raw transfer in COPY
+#define COPY_BLOCKS				3
+
+// failed members listed in a 207 multistatus, the rest is only counted
+#define DAV_MAX_REPORTED_FAILURES	16
 
 enum ResourceType { RESOURCE_NONE, RESOURCE_FILE, RESOURCE_DIR };
 enum DepthType { DEPTH_NONE, DEPTH_CHILD, DEPTH_ALL };
 
+// what a connection is doing between two slices
+enum ConnState { CONN_FREE, CONN_REQUEST, CONN_BODY_IN, CONN_BODY_OUT };
+enum JobType { JOB_NONE, JOB_GET, JOB_PUT, JOB_PROPFIND, JOB_COPY, JOB_DELETE, JOB_EXTRACT, JOB_ARCHIVE, JOB_CHANGES, JOB_DRAIN };
+enum ChunkState { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
+
 //using namespace sdfat;
 
-class ESPWebDAV	{
+// One client connection. Requests are parsed as bytes arrive and long
+// transfers run as jobs that do a bounded amount of work per process() call,
+// so several connections share the device without blocking each other.
+class DavConnection	{
 public:
-	bool init(int serverPort);
-	bool initSD(sdfat::SdSpiConfig config);
-	bool isClientWaiting();
-	void handleClient(String blank = "");
-	void rejectClient(String rejectMessage);
-	
+	void begin(sdfat::SdFat *card, WiFiClient newClient, const String& message);
+	bool isFree()				{ return state == CONN_FREE; }
+	// held until the card changes, it doesn't use the card meanwhile
+	bool isWaiting()			{ return job == JOB_CHANGES; }
+	void process();
+	void abort();
+
 protected:
-	typedef void (ESPWebDAV::*THandlerFunction)(String);
-	
-	void processClient(THandlerFunction handler, String message);
+	typedef void (DavConnection::*THandlerFunction)(String);
+
+	bool readRequest();
+	bool openPath(sdfat::FatFile *f, const String& path, sdfat::oflag_t oflag);
+	bool openCached(const String& path, sdfat::FatFile *f, FileMap *fMap);
+	bool isBodyReady();
+	void finish();
+	void startJob(JobType newJob, ConnState newState, size_t bufSize);
+	void endJob();
+	void endCardTransfer();
+
 	void handleNotFound();
 	void handleReject(String rejectMessage);
 	void handleRequest(String blank);
@@ -40,48 +110,164 @@ protected:
 	void handleLock(ResourceType resource);
 	void handleUnlock(ResourceType resource);
 	void handlePropPatch(ResourceType resource);
+	bool getXmlValue(const String& xml, const char *name, String *value);
+	bool parseHttpDate(const String& text, uint16_t *year, uint8_t *month, uint8_t *day, uint8_t *hour, uint8_t *minute, uint8_t *second);
+	bool wantsWin32Props();
 	void handleProp(ResourceType resource);
+	bool stepPropFind();
+	void invalidateCaches();
+	String httpDate(uint16_t pdate, uint16_t ptime);
 	void sendPropResponse(boolean recursing, sdfat::FatFile *curFile);
+	void sendQuota();
 	void handleGet(ResourceType resource, bool isGet);
+	int8_t parseOffset(const String& text, size_t *value);
+	int8_t parseRange(size_t fileSize, size_t *first, size_t *last);
+	bool stepGet();
 	void handlePut(ResourceType resource);
+	bool stepPut();
+	size_t readBody(uint8_t *dst, size_t maxLen);
+	bool stepDrain();
+	bool growContiguous(size_t newSize);
+	bool putError(const char *message);
 	void handleWriteError(String message, sdfat::FatFile *wFile);
 	void handleDirectoryCreate(ResourceType resource);
 	void handleMove(ResourceType resource);
+	void handleCopy(ResourceType resource);
+	void startCopy();
+	bool stepCopy();
+	bool beginCopyFile(const String& src, const String& dst);
+	void stepCopyFile();
+	void completeCopy();
+	void addFailure(const String& href, const char *status);
+	void sendFailures(const char *message);
 	void handleDelete(ResourceType resource);
+	void handleCompress(ResourceType resource);
+	void handleDefrag(ResourceType resource);
+	bool stepDelete();
+	void handleExtract(ResourceType resource);
+	bool stepExtract();
+	bool extractError(const char *code, const String& message);
+	void handleArchive(ResourceType resource);
+	bool stepArchive();
+	void handleChanges();
+	bool stepChanges();
 
 	// Sections are copied from ESP8266Webserver
-	String getMimeType(String path);
+	const char *getMimeType(const String& path);
 	String urlDecode(const String& text);
 	String urlToUri(String url);
-	bool parseRequest();
+	bool parseRequestLine(const String& req);
+	void parseHeader(const String& req);
+	bool parseChunkSize(const String& line, size_t *chunkSize);
 	void sendHeader(const String& name, const String& value, bool first = false);
 	void send(String code, const char* content_type, const String& content);
 	void _prepareHeader(String& response, String code, const char* content_type, size_t contentLength);
 	void sendContent(const String& content);
+	void sendChunk(const char *content, size_t size);
 	void sendContent_P(PGM_P content);
 	void setContentLength(size_t len);
 	size_t readBytesWithTimeout(uint8_t *buf, size_t bufSize);
 	size_t readBytesWithTimeout(uint8_t *buf, size_t bufSize, size_t numToRead);
-	
-	
-	// variables pertaining to current most HTTP request being serviced
-	WiFiServer *server;
-	sdfat::SdFat sd;
 
+
+	sdfat::SdFat *sd;
+	ConnState	state = CONN_FREE;
+	uint32_t	lastActivity;
+	String		lineBuf;
+	bool		headersDone;
+	String		rejectMessage;
+
+	// variables pertaining to current most HTTP request being serviced
 	WiFiClient 	client;
 	String 		method;
+	DavMethod	methodId;		// method as parsed from the request line
 	String 		uri;
+	String		query;
+	ResourceType resource;
+	uint32_t	resourceSize;
+	sdfat::DirFat_t resourceDir;	// entry of the resource when it was opened
 	String 		contentLengthHeader;
 	String 		depthHeader;
 	String 		hostHeader;
 	String		destinationHeader;
+	String		transferEncodingHeader;
+	String		expectedLengthHeader;
+	String		overwriteHeader;
+	String		rangeHeader;
+	String		acceptEncodingHeader;
+
+	// members that failed in a collection operation
+	String		failures;
+	uint16_t	numFailures;
 
 	String 		_responseHeaders;
 	bool		_chunked;
+	GzipStream	*gzip = NULL;	// compresses what sendContent() gets
 	int			_contentLength;
 
-	// SD stuff
-	bool isSDInit = false;
+	// state of the running job
+	JobType		job = JOB_NONE;
+	uint8_t		*buf = NULL;
+	size_t		bufSize;
+	uint32_t	tStart;
+	sdfat::SdFile file;			// the resource, GET/COPY source, PUT target, PROPFIND directory
+	sdfat::SdFile dFile;		// COPY target
+	bool		cardReading;
+	bool		cardWriting;
+	bool		contiguous;
+	FileMap		map;			// GET source sectors, empty for SdFat reads
+	uint32_t	filePos;
+	uint32_t	srcBlock;
+	uint32_t	bgnBlock;
+	uint32_t	endBlock;
+	uint32_t	numBlocks;
+	uint32_t	blockPos;
+	size_t		numRemaining;
+	size_t		numReceived;
+	size_t		fill;
+	size_t		extent;
+	bool		rawWrite;
+	bool		chunkedBody;
+	bool		bodyDone;
+	bool		bodyError;
+	ChunkState	chunkState;
+	size_t		chunkRemaining;
+	TreeWalker	*walker = NULL;
+	String		target;			// DELETE root or COPY destination root
+	String		copyTarget;		// file being copied
+	bool		targetExisted;
+	bool		copyAfterDelete;
+	String		propBody;		// PROPFIND listing being recorded or replayed
+	size_t		propPos;
+	bool		propCaching;
+	bool		win32Props;
+	bool		propReplay;
+	uint32_t	propGeneration;
+	DirIndex	*building = NULL;	// name index recorded by the listing
+	TarExtractor *extractor = NULL;	// unpacks the body of an extract request
+	ArchiveWriter *archive = NULL;	// collection being downloaded as an archive
+	uint32_t	changesSince;	// last change the waiting client has seen
+	bool		spooled;		// PUT received into the flash spool
+	fs::File	spoolFile;
+
+	// connections waiting for changes, one is always left for other requests
+	static uint8_t numWaiting;
+};
+
+class ESPWebDAV	{
+public:
+	bool init(int serverPort);
+	bool initSD(sdfat::SdSpiConfig config);
+	bool isClientWaiting();
+	void handleClient();
+	void rejectClient(String rejectMessage);
+	bool isIdle();
+
+protected:
+	void acceptClient(const String& message);
+
+	WiFiServer *server;
+	DavConnection conns[WEBDAV_MAX_CONNECTIONS];
 };
 
 #endif // ESPWEBDAV_H
@@ -0,0 +1,202 @@
+#include "FileCache.h"
+#include "CardVolume.h"
+
+using namespace sdfat;
+
+FileCache fileCache;
+
+// ------------------------
+void FileMap::begin(FatFile *file)	{
+// ------------------------
+	clear();
+
+	// an empty file has no cluster, FAT12 isn't mapped
+	FatVolume *vol = file->volume();
+	if(file->fileSize() && (vol->fatType() == 16 || vol->fatType() == 32))
+		add(vol, file->firstCluster());
+}
+
+
+
+// ------------------------
+bool FileMap::extend(FatFile *file, uint32_t maxFatSectors)	{
+// ------------------------
+	FatVolume *vol = file->volume();
+	uint32_t entriesPerSector = vol->fatType() == 32 ? 128 : 256;
+	uint32_t fileSectors = (file->fileSize() + 511) / 512;
+	uint32_t fatSector = 0;
+	uint8_t fat[512];
+
+	// the chain is followed in the FAT sectors themselves, a contiguous run
+	// of 128 clusters costs one read instead of a seek per cluster
+	while(lastCluster && numSectors < fileSectors)	{
+		uint32_t sector = vol->fatStartSector() + lastCluster / entriesPerSector;
+		if(sector != fatSector)	{
+			if(maxFatSectors-- == 0)
+				break;
+			if(!cardVolume.cache().readSector(sector, fat))	{
+				lastCluster = 0;
+				return false;
+			}
+			fatSector = sector;
+		}
+
+		uint32_t index = lastCluster % entriesPerSector;
+		uint32_t next;
+		if(entriesPerSector == 128)	{
+			memcpy(&next, fat + index * 4, 4);
+			next &= 0x0FFFFFFF;
+		}
+		else	{
+			uint16_t entry;
+			memcpy(&entry, fat + index * 2, 2);
+			next = entry >= 0xFFF8 ? 0x0FFFFFFF : entry;
+		}
+
+		// the end of the chain or a broken one ends the map
+		if(next < 2 || next >= 0x0FFFFFF8 || !add(vol, next))
+			lastCluster = 0;
+	}
+
+	if(numSectors >= fileSectors)
+		lastCluster = 0;
+	return numSectors > 0;
+}
+
+
+
+// ------------------------
+bool FileMap::add(FatVolume *vol, uint32_t cluster)	{
+// ------------------------
+	if(cluster < 2 || cluster - 2 >= vol->clusterCount())
+		return false;
+
+	uint32_t sectorsPerCluster = vol->sectorsPerCluster();
+	uint32_t cardSector = vol->dataStartSector() + (cluster - 2) * sectorsPerCluster;
+	Extent *last = numExtents ? &extents[numExtents - 1] : NULL;
+	if(last && last->cardSector + last->numSectors == cardSector)
+		last->numSectors += sectorsPerCluster;
+	else	{
+		// the map is full, the rest is read through SdFat
+		if(numExtents == FILECACHE_MAX_EXTENTS)
+			return false;
+
+		extents[numExtents].fileSector = numSectors;
+		extents[numExtents].cardSector = cardSector;
+		extents[numExtents].numSectors = sectorsPerCluster;
+		numExtents++;
+	}
+
+	numSectors += sectorsPerCluster;
+	lastCluster = cluster;
+	return true;
+}
+
+
+
+// ------------------------
+uint32_t FileMap::sector(uint32_t pos, uint32_t *numFollowing)	{
+// ------------------------
+	uint32_t fileSector = pos / 512;
+
+	// last extent starting at or before the sector
+	uint8_t lo = 0, hi = numExtents - 1;
+	while(lo < hi)	{
+		uint8_t mid = (lo + hi + 1) / 2;
+		if(extents[mid].fileSector <= fileSector)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	uint32_t offset = fileSector - extents[lo].fileSector;
+	*numFollowing = extents[lo].numSectors - offset;
+	return extents[lo].cardSector + offset;
+}
+
+
+
+// ------------------------
+bool FileCache::open(const String& path, FatFile *file, FileMap *map)	{
+// ------------------------
+	for(int i = 0; i < FILECACHE_HANDLES; i++)	{
+		Entry *entry = &entries[i];
+		if(!entry->path.length() || entry->path != path)
+			continue;
+
+		// the entry is read again, size, times and first cluster must match
+		DirFat_t dir;
+		if(!entry->file.dirEntry(&dir) || memcmp(&dir, &entry->dir, sizeof(dir)))	{
+			drop(entry);
+			return false;
+		}
+
+		entry->lastUse = ++useCounter;
+		*file = entry->file;
+		*map = entry->map;
+		file->seekSet(0);
+		return true;
+	}
+
+	return false;
+}
+
+
+
+// ------------------------
+void FileCache::add(const String& path, FatFile *file, FileMap *map)	{
+// ------------------------
+	// replace the same path or the least recently used handle
+	Entry *victim = &entries[0];
+	for(int i = 0; i < FILECACHE_HANDLES; i++)	{
+		if(entries[i].path == path)	{
+			victim = &entries[i];
+			break;
+		}
+		if(entries[i].lastUse < victim->lastUse)
+			victim = &entries[i];
+	}
+
+	drop(victim);
+	if(!file->dirEntry(&victim->dir))
+		return;
+
+	victim->path = path;
+	victim->file = *file;
+	victim->map = *map;
+	victim->lastUse = ++useCounter;
+}
+
+
+
+// ------------------------
+void FileCache::invalidate(const String& path)	{
+// ------------------------
+	String p = path;
+	if(p.length() > 1 && p.endsWith("/"))
+		p.remove(p.length() - 1);
+
+	// the file itself or a directory it is in
+	for(int i = 0; i < FILECACHE_HANDLES; i++)
+		if(entries[i].path.length() && (entries[i].path == p || entries[i].path.startsWith(p + "/")))
+			drop(&entries[i]);
+}
+
+
+
+// ------------------------
+void FileCache::clear()	{
+// ------------------------
+	for(int i = 0; i < FILECACHE_HANDLES; i++)
+		drop(&entries[i]);
+}
+
+
+
+// ------------------------
+void FileCache::drop(Entry *entry)	{
+// ------------------------
+	entry->file.close();
+	entry->path = "";
+	entry->lastUse = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+// read handles kept open between requests
+#define FILECACHE_HANDLES		4
+// pieces of a file mapped, the rest of a more fragmented one is read through SdFat
+#define FILECACHE_MAX_EXTENTS	16
+// FAT sectors read to map a file when it is opened, and per step of a GET
+// that reaches the end of the map; 128 clusters each on FAT32
+#define FILEMAP_OPEN_SECTORS	2
+#define FILEMAP_STEP_SECTORS	4
+
+// Where a file's data lies on the card. Runs of consecutive clusters are
+// kept with the file sector they start at, so the card sector of any
+// offset is found by a binary search instead of walking the FAT chain.
+// The map is built from FAT sectors read whole, a few at a time, and may
+// cover only the start of the file: the rest of a long chain is mapped as
+// a download gets there, a file in more extents than fit stays partly
+// mapped.
+struct FileMap	{
+	struct Extent	{
+		uint32_t	fileSector;
+		uint32_t	cardSector;
+		uint32_t	numSectors;
+	};
+
+	uint8_t		numExtents = 0;
+	uint32_t	numSectors = 0;			// file sectors mapped
+	uint32_t	lastCluster = 0;		// last one mapped, 0 once the map is done
+	Extent		extents[FILECACHE_MAX_EXTENTS];
+
+	void clear()					{ numExtents = 0; numSectors = 0; lastCluster = 0; }
+	void begin(sdfat::FatFile *file);
+	bool extend(sdfat::FatFile *file, uint32_t maxFatSectors);
+	bool covers(uint32_t pos)		{ return pos / 512 < numSectors; }
+	bool isDone()					{ return lastCluster == 0; }
+	uint32_t sector(uint32_t pos, uint32_t *numFollowing);
+
+protected:
+	bool add(sdfat::FatVolume *vol, uint32_t cluster);
+};
+
+// Open read-only handles with their maps, least recently used replaced. An
+// entry is only handed out while the file's directory entry is unchanged,
+// writes through WebDAV or FTP drop the path as well.
+class FileCache	{
+public:
+	bool open(const String& path, sdfat::FatFile *file, FileMap *map);
+	void add(const String& path, sdfat::FatFile *file, FileMap *map);
+	void invalidate(const String& path);
+	void clear();
+
+protected:
+	struct Entry	{
+		String		path;
+		sdfat::FatFile file;
+		sdfat::DirFat_t dir;
+		FileMap		map;
+		uint32_t	lastUse;
+	};
+
+	void drop(Entry *entry);
+
+	Entry		entries[FILECACHE_HANDLES];
+	uint32_t	useCounter = 0;
+};
+
+extern FileCache fileCache;
+
+#endif // FILECACHE_H
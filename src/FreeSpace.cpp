@@ -0,0 +1,146 @@
+#include "FreeSpace.h"
+#include "CardVolume.h"
+
+using namespace sdfat;
+
+FreeSpace freeSpace;
+
+// ------------------------
+void FreeSpace::mount(SdFat *card)	{
+// ------------------------
+	// called on every full mount, the printer may have changed the card
+	sd = card;
+	freeClusters = readFsInfo();
+
+	// FAT12 volumes are small enough to count right away
+	if(sd->fatType() == 12)	{
+		freeClusters = sd->freeClusterCount();
+		return;
+	}
+
+	scanning = true;
+	scanSector = 0;
+	scanFree = 0;
+}
+
+
+
+// ------------------------
+void FreeSpace::step()	{
+// ------------------------
+	if(!scanning)
+		return;
+
+	uint8_t buf[512];
+	uint32_t entriesPerSector = sd->fatType() == 32 ? 128 : 256;
+	// cluster numbers start at 2
+	uint32_t numEntries = sd->clusterCount() + 2;
+	uint32_t numSectors = (numEntries + entriesPerSector - 1) / entriesPerSector;
+
+	// through the sector cache, a FAT sector it holds dirty is written
+	// first; multi sector reads don't stay in it, the scan would push out
+	// the sectors listings use
+	SectorCache& cache = cardVolume.cache();
+	for(int i = 0; i < FREESPACE_SCAN_SECTORS && scanSector < numSectors; i++, scanSector++)	{
+		if(!cache.readSectors(sd->fatStartSector() + scanSector, buf, 1))	{
+			scanning = false;
+			return;
+		}
+
+		uint32_t first = scanSector * entriesPerSector;
+		for(uint32_t j = 0; j < entriesPerSector; j++)	{
+			uint32_t n = first + j;
+			if(n < 2 || n >= numEntries)
+				continue;
+
+			bool isFree;
+			if(entriesPerSector == 128)
+				isFree = !(((uint32_t *) buf)[j] & 0x0fffffff);
+			else
+				isFree = !((uint16_t *) buf)[j];
+			scanFree += isFree;
+		}
+	}
+
+	if(scanSector < numSectors)
+		return;
+
+	scanning = false;
+	freeClusters = scanFree;
+}
+
+
+
+// ------------------------
+int32_t FreeSpace::readFsInfo()	{
+// ------------------------
+	uint8_t buf[512];
+	if(sd->fatType() != 32 || !sd->card()->readSector(0, buf))
+		return -1;
+
+	// a partition table in front of the volume, or the volume itself
+	uint32_t volStart = 0;
+	if(buf[0] != 0xeb && buf[0] != 0xe9)
+		volStart = buf[0x1c6] | (buf[0x1c7] << 8) | (buf[0x1c8] << 16) | ((uint32_t) buf[0x1c9] << 24);
+
+	if(volStart && !sd->card()->readSector(volStart, buf))
+		return -1;
+
+	uint16_t fsInfo = buf[0x30] | (buf[0x31] << 8);
+	if(!fsInfo || fsInfo == 0xffff || !sd->card()->readSector(volStart + fsInfo, buf))
+		return -1;
+
+	// signatures, then the free count which may be unknown or stale
+	uint32_t *info = (uint32_t *) buf;
+	if(info[0] != 0x41615252 || info[121] != 0x61417272)
+		return -1;
+
+	uint32_t count = info[122];
+	return count <= sd->clusterCount() ? (int32_t) count : -1;
+}
+
+
+
+// ------------------------
+uint64_t FreeSpace::freeBytes()	{
+// ------------------------
+	return isKnown() ? (uint64_t) freeClusters * sd->bytesPerCluster() : 0;
+}
+
+
+
+// ------------------------
+uint64_t FreeSpace::usedBytes()	{
+// ------------------------
+	return isKnown() ? (uint64_t) (sd->clusterCount() - freeClusters) * sd->bytesPerCluster() : 0;
+}
+
+
+
+// ------------------------
+void FreeSpace::resized(uint32_t oldSize, uint32_t newSize)	{
+// ------------------------
+	if(!sd)
+		return;
+
+	// rounded up without adding first, sizes go up to 4 GiB - 1
+	uint32_t clusterSize = sd->bytesPerCluster();
+	int32_t oldClusters = oldSize / clusterSize + (oldSize % clusterSize != 0);
+	int32_t newClusters = newSize / clusterSize + (newSize % clusterSize != 0);
+	changed(oldClusters - newClusters);
+}
+
+
+
+// ------------------------
+void FreeSpace::changed(int32_t clusters)	{
+// ------------------------
+	if(isKnown())
+		freeClusters += clusters;
+
+	// part of the FAT may be counted already, start over
+	if(scanning)	{
+		scanSector = 0;
+		scanFree = 0;
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef FREESPACE_H
+#define FREESPACE_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+// FAT sectors counted per loop() while the card is idle
+#define FREESPACE_SCAN_SECTORS	16
+
+// Free cluster count of the card without a FAT scan per request. It starts
+// from the FSInfo hint of FAT32 cards and is made exact by a FAT scan done
+// in the background. WebDAV and FTP report what they allocate and free,
+// file sizes are rounded up to whole clusters.
+class FreeSpace	{
+public:
+	void mount(sdfat::SdFat *card);
+	void step();
+	bool isKnown()				{ return freeClusters >= 0; }
+	bool isScanning()			{ return scanning; }
+	uint64_t freeBytes();
+	uint64_t usedBytes();
+
+	void resized(uint32_t oldSize, uint32_t newSize);
+	void dirCreated()			{ changed(-1); }
+	void dirRemoved()			{ changed(1); }
+
+protected:
+	void changed(int32_t clusters);
+	int32_t readFsInfo();
+
+	sdfat::SdFat *sd = NULL;
+	int32_t		freeClusters = -1;
+	bool		scanning = false;
+	uint32_t	scanSector;
+	uint32_t	scanFree;
+};
+
+extern FreeSpace freeSpace;
+
+#endif // FREESPACE_H
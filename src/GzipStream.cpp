@@ -0,0 +1,270 @@
+#include "GzipStream.h"
+
+// RFC 1951 length and distance codes
+static const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// CRC-32 a nibble at a time, the full table would be 1 KB
+static const uint32_t crcTable[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+// ------------------------
+GzipStream::~GzipStream()	{
+// ------------------------
+	free(win);
+	free(head);
+	free(out);
+}
+
+
+
+// ------------------------
+bool GzipStream::begin(Sink output)	{
+// ------------------------
+	sink = output;
+	win = (uint8_t *) malloc(2 * GZIP_WINDOW);
+	head = (uint16_t *) calloc(1 << GZIP_HASH_BITS, sizeof(uint16_t));
+	out = (uint8_t *) malloc(GZIP_OUT_SIZE);
+	if(!win || !head || !out)
+		return false;
+
+	winFill = 0;
+	winPos = 0;
+	outFill = 0;
+	bitBuf = 0;
+	bitCount = 0;
+	crc = 0xffffffff;
+
+	// gzip member header: deflate, no name, no time, unknown OS
+	static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff };
+	for(int i = 0; i < 10; i++)
+		putByte(header[i]);
+
+	// one fixed Huffman block holds everything up to finish()
+	putBits(0, 1);
+	putBits(1, 2);
+	return true;
+}
+
+
+
+// ------------------------
+void GzipStream::write(const uint8_t *data, size_t len)	{
+// ------------------------
+	uint32_t t = micros();
+	totalIn += len;
+
+	while(len)	{
+		size_t n = min(len, (size_t) (2 * GZIP_WINDOW - winFill));
+		memcpy(win + winFill, data, n);
+		crc = updateCrc(crc, data, n);
+
+		winFill += n;
+		data += n;
+		len -= n;
+
+		compress(false);
+		if(winFill == 2 * GZIP_WINDOW)
+			slide();
+	}
+
+	busyMicros += micros() - t;
+}
+
+
+
+// ------------------------
+void GzipStream::finish()	{
+// ------------------------
+	uint32_t t = micros();
+	compress(true);
+
+	// end of block, then an empty final block
+	putSymbol(256);
+	putBits(1, 1);
+	putBits(1, 2);
+	putSymbol(256);
+	if(bitCount)
+		putBits(0, 8 - bitCount);
+
+	// trailer, little endian CRC and length
+	crc = ~crc;
+	for(int i = 0; i < 4; i++)
+		putByte(crc >> (8 * i));
+	for(int i = 0; i < 4; i++)
+		putByte(totalIn >> (8 * i));
+
+	flushOut();
+	busyMicros += micros() - t;
+}
+
+
+
+// ------------------------
+uint32_t GzipStream::updateCrc(uint32_t crc, const uint8_t *data, size_t len)	{
+// ------------------------
+	for(size_t i = 0; i < len; i++)	{
+		crc ^= data[i];
+		crc = (crc >> 4) ^ crcTable[crc & 15];
+		crc = (crc >> 4) ^ crcTable[crc & 15];
+	}
+	return crc;
+}
+
+
+
+// ------------------------
+void GzipStream::compress(bool flush)	{
+// ------------------------
+	// keep a full match of lookahead until the end of the input is known
+	while(winPos < winFill)	{
+		uint16_t avail = winFill - winPos;
+		if(!flush && avail < GZIP_MAX_MATCH)
+			break;
+
+		uint16_t bestLen = 0;
+		uint16_t bestDist = 0;
+		if(avail >= GZIP_MIN_MATCH)	{
+			// head holds position + 1 of the last string with this hash
+			uint16_t h = hash(win + winPos);
+			uint16_t cand = head[h];
+			head[h] = winPos + 1;
+
+			if(cand && winPos - (cand - 1) <= GZIP_WINDOW)	{
+				const uint8_t *a = win + cand - 1;
+				const uint8_t *b = win + winPos;
+				uint16_t maxLen = min(avail, (uint16_t) GZIP_MAX_MATCH);
+				uint16_t len = 0;
+				while(len < maxLen && a[len] == b[len])
+					len++;
+
+				if(len >= GZIP_MIN_MATCH)	{
+					bestLen = len;
+					bestDist = winPos - (cand - 1);
+				}
+			}
+		}
+
+		if(bestLen)	{
+			putMatch(bestLen, bestDist);
+
+			// the strings inside the match are candidates for later ones
+			for(uint16_t i = 1; i < bestLen && winPos + i + GZIP_MIN_MATCH <= winFill; i++)
+				head[hash(win + winPos + i)] = winPos + i + 1;
+			winPos += bestLen;
+		}
+		else
+			putSymbol(win[winPos++]);
+	}
+}
+
+
+
+// ------------------------
+void GzipStream::slide()	{
+// ------------------------
+	// drop the older half, what's left is the history for the next input
+	memmove(win, win + GZIP_WINDOW, winFill - GZIP_WINDOW);
+	winFill -= GZIP_WINDOW;
+	winPos -= GZIP_WINDOW;
+
+	for(int i = 0; i < (1 << GZIP_HASH_BITS); i++)
+		head[i] = head[i] > GZIP_WINDOW ? head[i] - GZIP_WINDOW : 0;
+}
+
+
+
+// ------------------------
+uint16_t GzipStream::hash(const uint8_t *p)	{
+// ------------------------
+	return ((p[0] << 6) ^ (p[1] << 3) ^ p[2]) & ((1 << GZIP_HASH_BITS) - 1);
+}
+
+
+
+// ------------------------
+void GzipStream::putSymbol(uint16_t symbol)	{
+// ------------------------
+	// fixed literal/length code
+	if(symbol < 144)
+		putCode(0x30 + symbol, 8);
+	else if(symbol < 256)
+		putCode(0x190 + symbol - 144, 9);
+	else if(symbol < 280)
+		putCode(symbol - 256, 7);
+	else
+		putCode(0xc0 + symbol - 280, 8);
+}
+
+
+
+// ------------------------
+void GzipStream::putMatch(uint16_t length, uint16_t distance)	{
+// ------------------------
+	int i = 28;
+	while(lengthBase[i] > length)
+		i--;
+	putSymbol(257 + i);
+	putBits(length - lengthBase[i], lengthExtra[i]);
+
+	int d = 29;
+	while(distBase[d] > distance)
+		d--;
+	putCode(d, 5);
+	putBits(distance - distBase[d], distExtra[d]);
+}
+
+
+
+// ------------------------
+void GzipStream::putCode(uint16_t code, uint8_t numBits)	{
+// ------------------------
+	// Huffman codes start with their most significant bit
+	uint16_t reversed = 0;
+	for(uint8_t i = 0; i < numBits; i++)	{
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+	putBits(reversed, numBits);
+}
+
+
+
+// ------------------------
+void GzipStream::putBits(uint32_t value, uint8_t numBits)	{
+// ------------------------
+	bitBuf |= value << bitCount;
+	bitCount += numBits;
+	while(bitCount >= 8)	{
+		putByte(bitBuf & 0xff);
+		bitBuf >>= 8;
+		bitCount -= 8;
+	}
+}
+
+
+
+// ------------------------
+void GzipStream::putByte(uint8_t b)	{
+// ------------------------
+	out[outFill++] = b;
+	if(outFill == GZIP_OUT_SIZE)
+		flushOut();
+}
+
+
+
+// ------------------------
+void GzipStream::flushOut()	{
+// ------------------------
+	if(!outFill)
+		return;
+
+	totalOut += outFill;
+	sink(out, outFill);
+	outFill = 0;
+}
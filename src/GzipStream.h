@@ -0,0 +1,60 @@
+#ifndef GZIPSTREAM_H
+#define GZIPSTREAM_H
+
+#include <Arduino.h>
+#include <functional>
+
+// history searched for repeats, a power of 2, twice this is buffered
+#define GZIP_WINDOW			1024
+#define GZIP_HASH_BITS		9
+// compressed bytes collected before they are passed on
+#define GZIP_OUT_SIZE		512
+
+#define GZIP_MIN_MATCH		3
+#define GZIP_MAX_MATCH		258
+
+// Streaming gzip encoder for generated text. Deflate with the fixed Huffman
+// codes of RFC 1951 and a single candidate hash match over a small window,
+// so it needs about 4 KB of heap and no code tables. Markup like PROPFIND
+// XML still shrinks to a fraction of its size.
+class GzipStream	{
+public:
+	typedef std::function<void(const uint8_t *data, size_t len)> Sink;
+
+	~GzipStream();
+	bool begin(Sink output);
+	void write(const uint8_t *data, size_t len);
+	void finish();
+
+	// running CRC-32, start with 0xffffffff and invert the result
+	static uint32_t updateCrc(uint32_t crc, const uint8_t *data, size_t len);
+
+	// for the debug output
+	uint32_t	totalIn = 0;
+	uint32_t	totalOut = 0;
+	uint32_t	busyMicros = 0;
+
+protected:
+	void compress(bool flush);
+	void slide();
+	uint16_t hash(const uint8_t *p);
+	void putSymbol(uint16_t symbol);
+	void putMatch(uint16_t length, uint16_t distance);
+	void putCode(uint16_t code, uint8_t numBits);
+	void putBits(uint32_t value, uint8_t numBits);
+	void putByte(uint8_t b);
+	void flushOut();
+
+	Sink		sink;
+	uint8_t		*win = NULL;
+	uint16_t	*head = NULL;
+	uint8_t		*out = NULL;
+	uint16_t	winFill;
+	uint16_t	winPos;
+	uint16_t	outFill;
+	uint32_t	bitBuf;
+	uint8_t		bitCount;
+	uint32_t	crc;
+};
+
+#endif // GZIPSTREAM_H
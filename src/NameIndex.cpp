@@ -0,0 +1,277 @@
+#include "NameIndex.h"
+
+using namespace sdfat;
+
+NameIndex nameIndex;
+
+// ------------------------
+static String trimSlash(const String& path)	{
+// ------------------------
+	String p = path;
+	if(p.length() > 1 && p.endsWith("/"))
+		p.remove(p.length() - 1);
+	return p;
+}
+
+
+
+// ------------------------
+DirIndex::~DirIndex()	{
+// ------------------------
+	dir.close();
+	free(bloom);
+	free(slots);
+}
+
+
+
+// ------------------------
+bool DirIndex::begin(const String& dirPath)	{
+// ------------------------
+	path = trimSlash(dirPath);
+
+	// members are opened by index below this directory
+	if(!dir.open(path.c_str(), O_READ) || !dir.isDir())
+		return false;
+
+	bloom = (uint8_t *) calloc(DIRINDEX_BLOOM_BYTES, 1);
+	numSlots = 64;
+	slots = (Slot *) malloc(numSlots * sizeof(Slot));
+	if(!bloom || !slots)
+		return false;
+
+	memset(slots, 0xff, numSlots * sizeof(Slot));
+	return true;
+}
+
+
+
+// ------------------------
+uint32_t DirIndex::hash(const char *name)	{
+// ------------------------
+	// FNV-1a over the name folded to lower case, FAT names ignore case
+	uint32_t h = 2166136261UL;
+	for(; *name; name++)	{
+		h ^= (uint8_t) tolower(*name);
+		h *= 16777619UL;
+	}
+	return h;
+}
+
+
+
+// ------------------------
+void DirIndex::add(const char *name, uint16_t dirIndex)	{
+// ------------------------
+	uint32_t h = hash(name);
+	uint32_t h2 = (h >> 16) | (h << 16);
+	for(int i = 0; i < 3; i++)	{
+		uint32_t bit = (h + i * h2) % (DIRINDEX_BLOOM_BYTES * 8);
+		bloom[bit / 8] |= 1 << (bit % 8);
+	}
+	numNames++;
+
+	// too many names for the table, misses are still answered by the filter
+	if(slots && (numNames * 2 > numSlots) && !grow())	{
+		free(slots);
+		slots = NULL;
+	}
+
+	if(slots)
+		insert((uint16_t) (h ^ (h >> 16)), dirIndex);
+}
+
+
+
+// ------------------------
+bool DirIndex::mayContain(uint32_t h)	{
+// ------------------------
+	uint32_t h2 = (h >> 16) | (h << 16);
+	for(int i = 0; i < 3; i++)	{
+		uint32_t bit = (h + i * h2) % (DIRINDEX_BLOOM_BYTES * 8);
+		if(!(bloom[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+	return true;
+}
+
+
+
+// ------------------------
+bool DirIndex::insert(uint16_t tag, uint16_t dirIndex)	{
+// ------------------------
+	// linear probing, 0xffff marks a free slot
+	for(uint16_t i = 0; i < numSlots; i++)	{
+		Slot *slot = &slots[(tag + i) & (numSlots - 1)];
+		if(slot->dirIndex == 0xffff)	{
+			slot->tag = tag;
+			slot->dirIndex = dirIndex;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+
+// ------------------------
+bool DirIndex::grow()	{
+// ------------------------
+	if(numSlots >= DIRINDEX_MAX_SLOTS)
+		return false;
+
+	Slot *old = slots;
+	uint16_t oldSlots = numSlots;
+
+	// the tag is the hash the slot was chosen by, so it's enough to rehash
+	numSlots *= 2;
+	slots = (Slot *) malloc(numSlots * sizeof(Slot));
+	if(!slots)	{
+		slots = old;
+		numSlots = oldSlots;
+		return false;
+	}
+
+	memset(slots, 0xff, numSlots * sizeof(Slot));
+	for(uint16_t i = 0; i < oldSlots; i++)
+		if(old[i].dirIndex != 0xffff)
+			insert(old[i].tag, old[i].dirIndex);
+
+	free(old);
+	return true;
+}
+
+
+
+// ------------------------
+int8_t DirIndex::open(FatFile *file, const char *name, oflag_t oflag)	{
+// ------------------------
+	uint32_t h = hash(name);
+	if(!mayContain(h))
+		return 0;
+
+	if(!slots)
+		return -1;
+
+	// candidates are checked by name, entries may have changed under us
+	char entryName[255];
+	uint16_t tag = (uint16_t) (h ^ (h >> 16));
+	for(uint16_t i = 0; i < numSlots; i++)	{
+		Slot *slot = &slots[(tag + i) & (numSlots - 1)];
+		if(slot->dirIndex == 0xffff)
+			return 0;
+
+		if(slot->tag != tag || !file->open(&dir, slot->dirIndex, oflag))
+			continue;
+
+		file->getName(entryName, sizeof(entryName));
+		if(!strcasecmp(entryName, name))
+			return 1;
+		file->close();
+	}
+
+	return -1;
+}
+
+
+
+// ------------------------
+int8_t NameIndex::open(FatFile *file, const String& path, oflag_t oflag)	{
+// ------------------------
+	String p = trimSlash(path);
+	int slash = p.lastIndexOf('/');
+	if(slash < 0)
+		return -1;
+
+	String parent = slash > 0 ? p.substring(0, slash) : String("/");
+	String name = p.substring(slash + 1);
+
+	// short name aliases like PROGRA~1 are not recorded
+	if(name.length() == 0 || name.indexOf('~') >= 0)
+		return -1;
+
+	for(int i = 0; i < DIRINDEX_DIRS; i++)	{
+		if(dirs[i] && dirs[i]->path == parent)	{
+			dirs[i]->lastUse = ++useCounter;
+			return dirs[i]->open(file, name.c_str(), oflag);
+		}
+	}
+
+	return -1;
+}
+
+
+
+// ------------------------
+DirIndex *NameIndex::beginBuild(const String& dirPath)	{
+// ------------------------
+	DirIndex *index = new DirIndex();
+	if(!index->begin(dirPath))	{
+		delete index;
+		return NULL;
+	}
+
+	index->generation = curGeneration;
+	return index;
+}
+
+
+
+// ------------------------
+void NameIndex::commit(DirIndex *index)	{
+// ------------------------
+	// a name created during the listing could be missing from the filter
+	if(index->generation != curGeneration || index->numNames < DIRINDEX_MIN_ENTRIES)	{
+		delete index;
+		return;
+	}
+
+	// replace the same directory or the least recently used index
+	int victim = 0;
+	for(int i = 0; i < DIRINDEX_DIRS; i++)	{
+		if(!dirs[i] || dirs[i]->path == index->path)	{
+			victim = i;
+			break;
+		}
+		if(dirs[i]->lastUse < dirs[victim]->lastUse)
+			victim = i;
+	}
+
+	delete dirs[victim];
+	index->lastUse = ++useCounter;
+	dirs[victim] = index;
+}
+
+
+
+// ------------------------
+void NameIndex::invalidate(const String& path)	{
+// ------------------------
+	curGeneration++;
+
+	// a new name belongs to its parent, a removed or moved directory takes
+	// its own index and those below it along
+	String p = trimSlash(path);
+	int slash = p.lastIndexOf('/');
+	String parent = slash > 0 ? p.substring(0, slash) : String("/");
+
+	for(int i = 0; i < DIRINDEX_DIRS; i++)	{
+		if(dirs[i] && (dirs[i]->path == parent || dirs[i]->path == p || dirs[i]->path.startsWith(p + "/")))	{
+			delete dirs[i];
+			dirs[i] = NULL;
+		}
+	}
+}
+
+
+
+// ------------------------
+void NameIndex::clear()	{
+// ------------------------
+	curGeneration++;
+
+	for(int i = 0; i < DIRINDEX_DIRS; i++)	{
+		delete dirs[i];
+		dirs[i] = NULL;
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef NAMEINDEX_H
+#define NAMEINDEX_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+// directories indexed at the same time
+#define DIRINDEX_DIRS			2
+// smaller directories are scanned faster than an index is built
+#define DIRINDEX_MIN_ENTRIES	32
+// negative filter, 16384 bits keep false positives under 3% up to 2000 names
+#define DIRINDEX_BLOOM_BYTES	2048
+// hash table for hits, directories beyond half of it keep only the filter
+#define DIRINDEX_MAX_SLOTS		1024
+
+// Names of one directory, recorded while a PROPFIND lists it. The Bloom
+// filter answers misses (desktop.ini, Thumbs.db, ...) without reading the
+// card, the table maps a name hash to the directory index of the entry.
+class DirIndex	{
+public:
+	~DirIndex();
+
+	bool begin(const String& dirPath);
+	void add(const char *name, uint16_t dirIndex);
+	int8_t open(sdfat::FatFile *file, const char *name, sdfat::oflag_t oflag);
+
+	String		path;
+	uint16_t	numNames = 0;
+	uint32_t	generation;
+	uint32_t	lastUse = 0;
+
+protected:
+	struct Slot	{
+		uint16_t	tag;
+		uint16_t	dirIndex;
+	};
+
+	static uint32_t hash(const char *name);
+	bool mayContain(uint32_t h);
+	bool insert(uint16_t tag, uint16_t dirIndex);
+	bool grow();
+
+	sdfat::FatFile dir;
+	uint8_t		*bloom = NULL;
+	Slot		*slots = NULL;
+	uint16_t	numSlots = 0;
+};
+
+// Indexes of the directories listed most recently. Lookups return 1 when
+// the file was opened, 0 when it certainly does not exist and -1 when the
+// caller has to fall back to a path open. Whatever creates names on the
+// card invalidates the parent's index.
+class NameIndex	{
+public:
+	int8_t open(sdfat::FatFile *file, const String& path, sdfat::oflag_t oflag);
+	DirIndex *beginBuild(const String& dirPath);
+	void commit(DirIndex *index);
+	void invalidate(const String& path);
+	void clear();
+
+protected:
+	DirIndex	*dirs[DIRINDEX_DIRS] = { NULL };
+	uint32_t	curGeneration = 0;
+	uint32_t	useCounter = 0;
+};
+
+extern NameIndex nameIndex;
+
+#endif // NAMEINDEX_H
@@ -0,0 +1,113 @@
+#include "PropCache.h"
+
+PropCache propCache;
+
+// ------------------------
+const String *PropCache::find(const String& path, bool win32)	{
+// ------------------------
+	for(int i = 0; i < PROPCACHE_ENTRIES; i++)	{
+		if(entries[i].path.length() && entries[i].path == path && entries[i].win32 == win32)	{
+			entries[i].lastUse = ++useCounter;
+			return &entries[i].body;
+		}
+	}
+
+	return NULL;
+}
+
+
+
+// ------------------------
+void PropCache::store(const String& path, bool win32, const String& body, uint32_t builtIn)	{
+// ------------------------
+	// something changed while the listing was read, it may be stale already
+	if(builtIn != curGeneration || body.length() > PROPCACHE_MAX_ENTRY)
+		return;
+
+	// replace the same listing or the least recently used one
+	Entry *victim = &entries[0];
+	for(int i = 0; i < PROPCACHE_ENTRIES; i++)	{
+		if(entries[i].path == path && entries[i].win32 == win32)	{
+			victim = &entries[i];
+			break;
+		}
+		if(entries[i].lastUse < victim->lastUse)
+			victim = &entries[i];
+	}
+	victim->path = "";
+	victim->body = "";
+
+	// then drop older listings until the new one fits the budget
+	for(;;)	{
+		size_t used = body.length();
+		Entry *oldest = NULL;
+		for(int i = 0; i < PROPCACHE_ENTRIES; i++)	{
+			if(!entries[i].path.length())
+				continue;
+			used += entries[i].body.length();
+			if(!oldest || entries[i].lastUse < oldest->lastUse)
+				oldest = &entries[i];
+		}
+		if(used <= PROPCACHE_MAX_BYTES || !oldest)
+			break;
+		oldest->path = "";
+		oldest->body = "";
+		oldest->lastUse = 0;
+	}
+
+	victim->path = path;
+	victim->win32 = win32;
+	victim->body = body;
+	victim->lastUse = ++useCounter;
+}
+
+
+
+// ------------------------
+void PropCache::invalidate(const String& path)	{
+// ------------------------
+	curGeneration++;
+
+	for(int i = 0; i < PROPCACHE_ENTRIES; i++)	{
+		if(entries[i].path.length() && matches(entries[i].path, path))	{
+			entries[i].path = "";
+			entries[i].body = "";
+			entries[i].lastUse = 0;
+		}
+	}
+}
+
+
+
+// ------------------------
+void PropCache::clear()	{
+// ------------------------
+	curGeneration++;
+
+	for(int i = 0; i < PROPCACHE_ENTRIES; i++)	{
+		entries[i].path = "";
+		entries[i].body = "";
+		entries[i].lastUse = 0;
+	}
+}
+
+
+
+// ------------------------
+bool PropCache::matches(const String& key, const String& path)	{
+// ------------------------
+	// compare without trailing slashes, clients use both forms
+	String k = key;
+	String p = path;
+	if(k.length() > 1 && k.endsWith("/"))
+		k.remove(k.length() - 1);
+	if(p.length() > 1 && p.endsWith("/"))
+		p.remove(p.length() - 1);
+
+	// the changed entry shows up in its parent's listing, its own listing
+	// and, for a collection, in every listing below it
+	int slash = p.lastIndexOf('/');
+	String parent = slash > 0 ? p.substring(0, slash) : String("/");
+
+	return k == parent || k == p || k.startsWith(p + "/");
+}
@@ -0,0 +1,44 @@
+#ifndef PROPCACHE_H
+#define PROPCACHE_H
+
+#include <Arduino.h>
+
+// directory listings kept in RAM
+#define PROPCACHE_ENTRIES		4
+// listings larger than this are always built from the card
+#define PROPCACHE_MAX_ENTRY		8192
+// all listings together, older ones make room for a new one
+#define PROPCACHE_MAX_BYTES		12288
+
+// Serialized PROPFIND Depth 1 bodies keyed by the request path. FAT does not
+// touch a directory's own entry when its children change, so listings are
+// not validated against the card but dropped by everything that writes to it.
+// A listing is only stored if nothing was invalidated while it was built.
+// Clients asking for the Windows properties get a longer variant of the
+// same listing, both are kept apart.
+class PropCache	{
+public:
+	const String *find(const String& path, bool win32);
+	uint32_t generation()		{ return curGeneration; }
+	void store(const String& path, bool win32, const String& body, uint32_t builtIn);
+	void invalidate(const String& path);
+	void clear();
+
+protected:
+	static bool matches(const String& key, const String& path);
+
+	struct Entry	{
+		String		path;
+		String		body;
+		bool		win32;
+		uint32_t	lastUse;
+	};
+
+	Entry		entries[PROPCACHE_ENTRIES];
+	uint32_t	curGeneration = 0;
+	uint32_t	useCounter = 0;
+};
+
+extern PropCache propCache;
+
+#endif // PROPCACHE_H
@@ -0,0 +1,145 @@
+#include "SectorCache.h"
+
+using namespace sdfat;
+
+// ------------------------
+void SectorCache::begin(FsBlockDevice *device)	{
+// ------------------------
+	dev = device;
+	for(int i = 0; i < SECTOR_CACHE_SECTORS; i++)
+		slots[i].valid = false;
+}
+
+
+
+// ------------------------
+void SectorCache::invalidate(uint32_t sector, uint32_t count)	{
+// ------------------------
+	for(int i = 0; i < SECTOR_CACHE_SECTORS; i++)
+		if(slots[i].valid && slots[i].sector - sector < count)
+			slots[i].valid = false;
+}
+
+
+
+// ------------------------
+bool SectorCache::isBusy()	{
+// ------------------------
+	return dev->isBusy();
+}
+
+
+
+// ------------------------
+bool SectorCache::readSector(uint32_t sector, uint8_t *dst)	{
+// ------------------------
+	int slot = find(sector);
+	if(slot >= 0)	{
+		numHits++;
+		memcpy(dst, data[slot], 512);
+		return true;
+	}
+	numMisses++;
+
+	// the least recently used slot makes room, written back first if needed
+	slot = 0;
+	for(int i = 0; i < SECTOR_CACHE_SECTORS; i++)	{
+		if(!slots[i].valid)	{
+			slot = i;
+			break;
+		}
+		if(slots[i].lastUse < slots[slot].lastUse)
+			slot = i;
+	}
+
+	if(!flush(slot))
+		return false;
+	slots[slot].valid = false;
+	if(!dev->readSector(sector, data[slot]))
+		return false;
+
+	slots[slot].sector = sector;
+	slots[slot].lastUse = ++useCounter;
+	slots[slot].valid = true;
+	slots[slot].dirty = false;
+	memcpy(dst, data[slot], 512);
+	return true;
+}
+
+
+
+// ------------------------
+bool SectorCache::readSectors(uint32_t sector, uint8_t *dst, size_t ns)	{
+// ------------------------
+	// the card has to be up to date for the range
+	return flushRange(sector, ns) && dev->readSectors(sector, dst, ns);
+}
+
+
+
+// ------------------------
+bool SectorCache::writeSector(uint32_t sector, const uint8_t *src)	{
+// ------------------------
+	int slot = find(sector);
+	if(slot < 0)
+		return dev->writeSector(sector, src);
+
+	memcpy(data[slot], src, 512);
+	slots[slot].dirty = true;
+	return true;
+}
+
+
+
+// ------------------------
+bool SectorCache::writeSectors(uint32_t sector, const uint8_t *src, size_t ns)	{
+// ------------------------
+	invalidate(sector, ns);
+	return dev->writeSectors(sector, src, ns);
+}
+
+
+
+// ------------------------
+bool SectorCache::syncDevice()	{
+// ------------------------
+	return flushRange(0, (uint32_t) -1) && dev->syncDevice();
+}
+
+
+
+// ------------------------
+int SectorCache::find(uint32_t sector)	{
+// ------------------------
+	for(int i = 0; i < SECTOR_CACHE_SECTORS; i++)	{
+		if(slots[i].valid && slots[i].sector == sector)	{
+			slots[i].lastUse = ++useCounter;
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+
+// ------------------------
+bool SectorCache::flush(int slot)	{
+// ------------------------
+	if(!slots[slot].valid || !slots[slot].dirty)
+		return true;
+	if(!dev->writeSector(slots[slot].sector, data[slot]))
+		return false;
+	slots[slot].dirty = false;
+	return true;
+}
+
+
+
+// ------------------------
+bool SectorCache::flushRange(uint32_t sector, size_t ns)	{
+// ------------------------
+	for(int i = 0; i < SECTOR_CACHE_SECTORS; i++)
+		if(slots[i].valid && slots[i].sector - sector < ns && !flush(i))
+			return false;
+	return true;
+}
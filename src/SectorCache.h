@@ -0,0 +1,53 @@
+#ifndef SECTORCACHE_H
+#define SECTORCACHE_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+// sectors kept in RAM below the volume, 512 bytes each
+#define SECTOR_CACHE_SECTORS	4
+
+// LRU cache of single sectors between the mounted volume and the card.
+// SdFat only keeps the last FAT and the last data sector, listings and
+// growing cluster chains read and write the same few sectors over and over.
+//
+// Single sector reads are cached. Writes go into the cache only if the
+// sector is already there, they stay dirty until the volume syncs; file
+// data written whole goes straight to the card and doesn't push the FAT
+// and directory sectors out. Multi sector transfers go to the card.
+// Raw transfers that bypass the volume have to invalidate what they write.
+class SectorCache : public sdfat::FsBlockDeviceInterface	{
+public:
+	void begin(sdfat::FsBlockDevice *device);
+	void invalidate(uint32_t sector, uint32_t count);
+	uint32_t hits()				{ return numHits; }
+	uint32_t misses()			{ return numMisses; }
+
+	bool isBusy() override;
+	bool readSector(uint32_t sector, uint8_t *dst) override;
+	bool readSectors(uint32_t sector, uint8_t *dst, size_t ns) override;
+	bool writeSector(uint32_t sector, const uint8_t *src) override;
+	bool writeSectors(uint32_t sector, const uint8_t *src, size_t ns) override;
+	bool syncDevice() override;
+
+protected:
+	int find(uint32_t sector);
+	bool flush(int slot);
+	bool flushRange(uint32_t sector, size_t ns);
+
+	struct Slot	{
+		uint32_t	sector;
+		uint32_t	lastUse;
+		bool		valid;
+		bool		dirty;
+	};
+
+	sdfat::FsBlockDevice *dev = NULL;
+	Slot		slots[SECTOR_CACHE_SECTORS];
+	uint8_t		data[SECTOR_CACHE_SECTORS][512];
+	uint32_t	useCounter = 0;
+	uint32_t	numHits = 0;
+	uint32_t	numMisses = 0;
+};
+
+#endif // SECTORCACHE_H
@@ -0,0 +1,205 @@
+#include "SidecarBuilder.h"
+#include "CardCache.h"
+#include "CardVolume.h"
+#include "FreeSpace.h"
+#include "ChangeJournal.h"
+
+using namespace sdfat;
+
+SidecarBuilder sidecarBuilder;
+
+// text formats that compress well
+static const char *extensions[] = { ".gcode", ".gco", ".g", ".txt", ".htm", ".html", ".css", ".js", ".json", ".xml", ".svg", ".csv" };
+
+// ------------------------
+bool SidecarBuilder::start(const String& root)	{
+// ------------------------
+	if(walker)
+		return false;
+
+	walker = new TreeWalker();
+	if(!walker->begin(root))	{
+		delete walker;
+		walker = NULL;
+		return false;
+	}
+
+	numBuilt = 0;
+	return true;
+}
+
+
+
+// ------------------------
+void SidecarBuilder::step()	{
+// ------------------------
+	if(!walker)
+		return;
+
+	uint32_t sliceStart = millis();
+	uint8_t buf[512];
+
+	while((millis() - sliceStart) < SIDECAR_SLICE_MS)	{
+		if(gzip)	{
+			// compress the current file a sector at a time
+			int n = src.read(buf, sizeof(buf));
+			if(n > 0)	{
+				gzip->write(buf, n);
+				continue;
+			}
+
+			endFile(n == 0 && !writeFailed);
+			continue;
+		}
+
+		// look for the next file without a current sidecar
+		if(!walker->next())	{
+			Serial.print(numBuilt); Serial.println(" gzip sidecars built");
+			delete walker;
+			walker = NULL;
+			return;
+		}
+
+		if(walker->entry() == WALK_FILE && isCandidate(walker->path()) && needsRefresh(walker->path()))
+			beginFile(walker->path());
+	}
+}
+
+
+
+// ------------------------
+void SidecarBuilder::drop(const String& path)	{
+// ------------------------
+	// spooled uploads report their target before the card is back
+	if(!cardVolume.isMounted() || !isCandidate(path))
+		return;
+
+	// a sidecar being built from the old contents would be stale too
+	if(gzip && srcPath == path)
+		endFile(false);
+
+	String gzPath = path + ".gz";
+	FatFile gz;
+	if(!gz.open(gzPath.c_str(), O_RDWR))
+		return;
+
+	uint32_t size = gz.fileSize();
+	if(gz.remove())	{
+		freeSpace.resized(size, 0);
+		changeJournal.record(CHANGE_DELETED, gzPath);
+		cardChanged(gzPath);
+	}
+}
+
+
+
+// ------------------------
+bool SidecarBuilder::isCandidate(const String& path)	{
+// ------------------------
+	for(unsigned int i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++)
+		if(path.endsWith(extensions[i]))
+			return true;
+	return false;
+}
+
+
+
+// ------------------------
+bool SidecarBuilder::needsRefresh(const String& path)	{
+// ------------------------
+	FatFile s, gz;
+	if(!s.open(path.c_str(), O_READ) || s.fileSize() < SIDECAR_MIN_SIZE)
+		return false;
+
+	String gzPath = path + ".gz";
+	return !gz.open(gzPath.c_str(), O_READ) || !isCurrent(&s, &gz);
+}
+
+
+
+// ------------------------
+bool SidecarBuilder::isCurrent(FatFile *src, FatFile *gz)	{
+// ------------------------
+	uint16_t sDate, sTime, gDate, gTime;
+	if(!src->getModifyDateTime(&sDate, &sTime) || !gz->getModifyDateTime(&gDate, &gTime))
+		return false;
+
+	// the builder stamps the sidecar with the time of its source
+	if(((uint32_t) gDate << 16 | gTime) < ((uint32_t) sDate << 16 | sTime))
+		return false;
+
+	// gzip ends with the uncompressed length, little endian
+	uint8_t trailer[4];
+	if(gz->fileSize() < 18 || !gz->seekSet(gz->fileSize() - 4) || gz->read(trailer, 4) != 4)
+		return false;
+
+	uint32_t length = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t) trailer[3] << 24);
+	return length == src->fileSize();
+}
+
+
+
+// ------------------------
+bool SidecarBuilder::beginFile(const String& path)	{
+// ------------------------
+	// the sidecar is written under a temporary name and renamed when done
+	String tmpPath = path + ".gz~";
+	if(!src.open(path.c_str(), O_READ) || !dst.open(tmpPath.c_str(), O_CREAT | O_WRITE | O_TRUNC))	{
+		src.close();
+		return false;
+	}
+
+	srcPath = path;
+	writeFailed = false;
+	gzip = new GzipStream();
+	if(!gzip->begin([this](const uint8_t *data, size_t len) { writeFailed |= dst.write(data, len) != len; }))	{
+		endFile(false);
+		return false;
+	}
+
+	return true;
+}
+
+
+
+// ------------------------
+void SidecarBuilder::endFile(bool ok)	{
+// ------------------------
+	String gzPath = srcPath + ".gz";
+	String tmpPath = srcPath + ".gz~";
+
+	if(ok)	{
+		gzip->finish();
+		ok = !writeFailed;
+	}
+
+	delete gzip;
+	gzip = NULL;
+
+	// same time as the source, so isCurrent() can tell it's from this version
+	uint16_t pdate, ptime;
+	if(ok && src.getModifyDateTime(&pdate, &ptime))
+		ok = dst.timestamp(T_WRITE, FS_YEAR(pdate), FS_MONTH(pdate), FS_DAY(pdate), FS_HOUR(ptime), FS_MINUTE(ptime), FS_SECOND(ptime));
+
+	src.close();
+	if(!ok)	{
+		dst.remove();
+		return;
+	}
+
+	freeSpace.resized(0, dst.fileSize());
+	dst.close();
+	FatFile old;
+	if(old.open(gzPath.c_str(), O_RDWR))	{
+		freeSpace.resized(old.fileSize(), 0);
+		old.remove();
+	}
+
+	if(dst.open(tmpPath.c_str(), O_RDWR) && dst.rename(gzPath.c_str()))	{
+		numBuilt++;
+		changeJournal.record(CHANGE_WRITTEN, gzPath);
+	}
+	dst.close();
+
+	cardChanged(gzPath);
+}
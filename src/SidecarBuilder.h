@@ -0,0 +1,47 @@
+#ifndef SIDECARBUILDER_H
+#define SIDECARBUILDER_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include "TreeWalker.h"
+#include "GzipStream.h"
+
+// smaller files are not worth a sidecar
+#define SIDECAR_MIN_SIZE	(16UL * 1024)
+// time the builder may use per loop() while the card is idle
+#define SIDECAR_SLICE_MS	20
+
+// Creates and refreshes "name.gz" next to text files below a directory, so
+// GET can send them compressed without compressing in real time. Work is
+// done in slices from loop() and only while nobody else uses the card.
+// Without a clock the stamps can't tell an old sidecar from a new one, so
+// whatever writes, moves or deletes a source drops its sidecar with drop().
+// isCurrent() catches the rest, a sidecar older than its source or one
+// whose gzip trailer doesn't match the source's size.
+class SidecarBuilder	{
+public:
+	bool start(const String& root);
+	bool isRunning()			{ return walker != NULL; }
+	void step();
+	void drop(const String& path);
+
+	static bool isCurrent(sdfat::FatFile *src, sdfat::FatFile *gz);
+
+protected:
+	bool isCandidate(const String& path);
+	bool needsRefresh(const String& path);
+	bool beginFile(const String& path);
+	void endFile(bool ok);
+
+	TreeWalker	*walker = NULL;
+	GzipStream	*gzip = NULL;
+	sdfat::FatFile src;
+	sdfat::FatFile dst;
+	String		srcPath;
+	bool		writeFailed;
+	uint16_t	numBuilt;
+};
+
+extern SidecarBuilder sidecarBuilder;
+
+#endif // SIDECARBUILDER_H
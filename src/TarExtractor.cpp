@@ -0,0 +1,317 @@
+#include <time.h>
+#include "TarExtractor.h"
+#include "CardCache.h"
+#include "SidecarBuilder.h"
+#include "FreeSpace.h"
+#include "ChangeJournal.h"
+
+using namespace sdfat;
+
+// ------------------------
+static uint32_t octal(const uint8_t *field, int len)	{
+// ------------------------
+	// leading spaces, digits, then a space or NUL
+	int i = 0;
+	while(i < len && field[i] == ' ')
+		i++;
+
+	uint32_t value = 0;
+	for(; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		value = value * 8 + field[i] - '0';
+	return value;
+}
+
+
+
+// ------------------------
+static String text(const uint8_t *field, int len)	{
+// ------------------------
+	// NUL terminated unless the field is full
+	String value;
+	for(int i = 0; i < len && field[i]; i++)
+		value += (char) field[i];
+	return value;
+}
+
+
+
+// ------------------------
+void TarExtractor::begin(SdFat *card, const String& root)	{
+// ------------------------
+	sd = card;
+	rootPath = root;
+	while(rootPath.endsWith("/"))
+		rootPath.remove(rootPath.length() - 1);
+
+	lastDir = String();
+	meta = String();
+	metaType = 0;
+	metaTooLong = false;
+	remaining = 0;
+	numZeroBlocks = 0;
+	filesDone = 0;
+}
+
+
+
+// ------------------------
+TarResult TarExtractor::block(const uint8_t *data)	{
+// ------------------------
+	// whatever follows the end of the archive is padding
+	if(numZeroBlocks >= 2)
+		return TAR_END;
+
+	if(remaining)	{
+		uint32_t n = min(remaining, (uint32_t) 512);
+		remaining -= n;
+
+		// a long name or pax records for the next header
+		if(metaType)	{
+			for(uint32_t i = 0; i < n && data[i]; i++)	{
+				if(meta.length() >= TAR_MAX_META)	{
+					metaTooLong = true;
+					break;
+				}
+				meta += (char) data[i];
+			}
+
+			if(remaining == 0 && metaType == 'x')	{
+				// "length key=value\n" records, only the path is used
+				String records = meta;
+				meta = String();
+				unsigned int pos = 0;
+				while(pos < records.length())	{
+					int space = records.indexOf(' ', pos);
+					int len = records.substring(pos, space).toInt();
+					if(space < 0 || len <= 0)
+						break;
+
+					String record = records.substring(space + 1, pos + len - 1);
+					if(record.startsWith("path="))
+						meta = record.substring(5);
+					pos += len;
+				}
+			}
+
+			if(remaining == 0)
+				metaType = 0;
+			return TAR_OK;
+		}
+
+		if(!file.isOpen())
+			return TAR_OK;
+
+		if(!writeFailed && file.write(data, n) != n)
+			writeFailed = true;
+		return remaining ? TAR_OK : endFile();
+	}
+
+	// two zero blocks end the archive
+	bool isZero = true;
+	for(int i = 0; i < 512 && isZero; i++)
+		isZero = !data[i];
+	if(isZero)	{
+		numZeroBlocks++;
+		return numZeroBlocks >= 2 ? TAR_END : TAR_OK;
+	}
+
+	numZeroBlocks = 0;
+	return header(data);
+}
+
+
+
+// ------------------------
+TarResult TarExtractor::header(const uint8_t *data)	{
+// ------------------------
+	if(data[0] == 0x1f && data[1] == 0x8b)	{
+		curPath = "Compressed archives are not supported, send a plain tar";
+		return TAR_INVALID;
+	}
+
+	// the checksum field itself counts as spaces
+	uint32_t sum = 0;
+	for(int i = 0; i < 512; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : data[i];
+	if(sum != octal(data + 148, 8))	{
+		curPath = "Invalid tar header";
+		return TAR_INVALID;
+	}
+
+	remaining = octal(data + 124, 12);
+	mtime = octal(data + 136, 12);
+	char type = data[156];
+
+	// GNU long names and pax headers describe the entry after them
+	if(type == 'L' || type == 'x')	{
+		metaType = remaining ? type : 0;
+		meta = String();
+		metaTooLong = false;
+		return TAR_OK;
+	}
+
+	String name = meta;
+	meta = String();
+	if(!name.length())	{
+		name = text(data, 100);
+		// ustar splits longer names into a prefix and the name
+		String prefix = text(data + 345, 155);
+		if(!memcmp(data + 257, "ustar", 5) && prefix.length())
+			name = prefix + "/" + name;
+	}
+
+	bool tooLong = metaTooLong;
+	metaTooLong = false;
+	bool safe = cleanPath(&name);
+	curPath = rootPath + "/" + name;
+
+	// global pax headers and the archive root itself
+	if(type == 'g' || name.length() == 0)
+		return TAR_OK;
+
+	if(tooLong || !safe)
+		return TAR_ENTRY_FAILED;
+
+	if(type == '5')
+		return makeDirs(curPath) ? TAR_OK : TAR_ENTRY_FAILED;
+
+	if(type == '0' || type == '\0' || type == '7')
+		return beginFile();
+
+	// links and devices have no place on FAT, their data is skipped
+	return TAR_ENTRY_FAILED;
+}
+
+
+
+// ------------------------
+TarResult TarExtractor::beginFile()	{
+// ------------------------
+	if(!makeDirs(curPath.substring(0, curPath.lastIndexOf('/'))))
+		return TAR_ENTRY_FAILED;
+
+	if(!file.open(curPath.c_str(), O_RDWR | O_CREAT))
+		return TAR_ENTRY_FAILED;
+
+	oldSize = file.fileSize();
+	writeFailed = false;
+	if(!file.truncate(0))	{
+		file.close();
+		return TAR_ENTRY_FAILED;
+	}
+
+	// the clusters are allocated in one go, without it the FAT is updated
+	// per cluster. It is fine to go on without when the card is fragmented.
+	if(remaining)	{
+		file.preAllocate(remaining);
+		return TAR_OK;
+	}
+
+	return endFile();
+}
+
+
+
+// ------------------------
+TarResult TarExtractor::endFile()	{
+// ------------------------
+	// the directory entry is written once, when the file is closed
+	if(!writeFailed && mtime)	{
+		time_t t = mtime;
+		struct tm *tm = gmtime(&t);
+		file.timestamp(T_WRITE, tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+	}
+
+	uint32_t newSize = file.fileSize();
+	if(writeFailed)	{
+		file.remove();
+		newSize = 0;
+	}
+	else
+		writeFailed = !file.close();
+
+	freeSpace.resized(oldSize, newSize);
+	cardChanged(curPath);
+	sidecarBuilder.drop(curPath);
+
+	if(writeFailed)
+		return TAR_ENTRY_FAILED;
+
+	changeJournal.record(CHANGE_WRITTEN, curPath);
+	filesDone++;
+	return TAR_OK;
+}
+
+
+
+// ------------------------
+TarResult TarExtractor::finish()	{
+// ------------------------
+	// an entry without all of its data
+	if(file.isOpen())	{
+		abort();
+		return TAR_ENTRY_FAILED;
+	}
+
+	return TAR_END;
+}
+
+
+
+// ------------------------
+void TarExtractor::abort()	{
+// ------------------------
+	if(!file.isOpen())
+		return;
+
+	file.remove();
+	freeSpace.resized(oldSize, 0);
+	cardChanged(curPath);
+	sidecarBuilder.drop(curPath);
+}
+
+
+
+// ------------------------
+bool TarExtractor::makeDirs(const String& dir)	{
+// ------------------------
+	// files of one directory come in a row, it is checked once for all
+	if(dir == lastDir)
+		return true;
+
+	// the root exists, each level below it is created when missing
+	int pos = rootPath.length();
+	while(pos >= 0)	{
+		pos = dir.indexOf('/', pos + 1);
+		String part = pos < 0 ? dir : dir.substring(0, pos);
+		if(!part.length() || sd->exists(part.c_str()))
+			continue;
+
+		if(!sd->mkdir(part.c_str(), false))
+			return false;
+		freeSpace.dirCreated();
+		changeJournal.record(CHANGE_CREATED, part);
+		cardChanged(part);
+	}
+
+	lastDir = dir;
+	return true;
+}
+
+
+
+// ------------------------
+bool TarExtractor::cleanPath(String *path)	{
+// ------------------------
+	while(path->startsWith("./"))
+		path->remove(0, 2);
+	while(path->startsWith("/"))
+		path->remove(0, 1);
+	while(path->endsWith("/"))
+		path->remove(path->length() - 1);
+	if(*path == ".")
+		*path = String();
+
+	// nothing may end up outside the target directory
+	return ("/" + *path + "/").indexOf("/../") < 0;
+}
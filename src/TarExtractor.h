@@ -0,0 +1,52 @@
+#ifndef TAREXTRACTOR_H
+#define TAREXTRACTOR_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+// longest GNU long name or pax header kept, bigger ones fail the entry
+#define TAR_MAX_META	1024
+
+enum TarResult { TAR_OK, TAR_ENTRY_FAILED, TAR_END, TAR_INVALID };
+
+// Unpacks a tar stream below a directory as it arrives, one 512 byte block
+// at a time. Files are preallocated from the size in their header and their
+// blocks written whole, so SdFat passes them to the card without its cache.
+// Directory entries are written once per file when it is closed, parent
+// directories are created as needed. Understands ustar, GNU long names and
+// the path record of pax headers. Compressed archives are refused.
+class TarExtractor	{
+public:
+	void begin(sdfat::SdFat *card, const String& root);
+	TarResult block(const uint8_t *data);
+	TarResult finish();
+	void abort();
+
+	// entry that failed, or why the archive is invalid
+	const String& failedPath()	{ return curPath; }
+	uint16_t numFiles()			{ return filesDone; }
+
+protected:
+	TarResult header(const uint8_t *data);
+	TarResult beginFile();
+	TarResult endFile();
+	bool makeDirs(const String& dir);
+	bool cleanPath(String *path);
+
+	sdfat::SdFat *sd;
+	String		rootPath;
+	String		lastDir;		// parent of the previous entry, known to exist
+	String		curPath;
+	String		meta;			// long name or pax records for the next entry
+	char		metaType;
+	bool		metaTooLong;
+	sdfat::FatFile file;
+	uint32_t	oldSize;
+	uint32_t	remaining;		// data bytes left of the current entry
+	uint32_t	mtime;
+	bool		writeFailed;
+	uint8_t		numZeroBlocks;
+	uint16_t	filesDone;
+};
+
+#endif // TAREXTRACTOR_H
@@ -0,0 +1,113 @@
+#include "TreeWalker.h"
+
+using namespace sdfat;
+
+// ------------------------
+bool TreeWalker::begin(const String& root)	{
+// ------------------------
+	end();
+
+	dirPath = root;
+	if(dirPath.endsWith("/"))
+		dirPath.remove(dirPath.length() - 1);
+	rootLen = dirPath.length();
+
+	if(!dirs[0].open(root.c_str(), O_READ) || !dirs[0].isDir())	{
+		dirs[0].close();
+		return false;
+	}
+
+	depth = 1;
+	return true;
+}
+
+
+
+// ------------------------
+bool TreeWalker::next()	{
+// ------------------------
+	if(depth == 0)
+		return false;
+
+	FatFile child;
+	if(child.openNext(&dirs[depth - 1], O_READ))	{
+		char name[255];
+		child.getName(name, sizeof(name));
+		curPath = dirPath + "/" + name;
+		curIndex = child.dirIndex();
+		curSize = child.fileSize();
+		child.dirEntry(&curDir);
+
+		if(!child.isDir())
+			curEntry = WALK_FILE;
+		else if(depth >= WALK_MAX_DEPTH)
+			curEntry = WALK_DIR_TOO_DEEP;
+		else	{
+			// descend, reopening by index avoids another name lookup
+			if(!dirs[depth].open(&dirs[depth - 1], child.dirIndex(), O_READ))
+				curEntry = WALK_DIR_TOO_DEEP;
+			else	{
+				curEntry = WALK_DIR_ENTER;
+				dirPath = curPath;
+				depth++;
+			}
+		}
+
+		child.close();
+		return true;
+	}
+
+	// this directory is done, the walk root itself is not reported
+	curIndex = dirs[--depth].dirIndex();
+	dirs[depth].close();
+	if(depth == 0)
+		return false;
+
+	curEntry = WALK_DIR_LEAVE;
+	curPath = dirPath;
+	curSize = 0;
+	dirPath.remove(dirPath.lastIndexOf('/'));
+	return true;
+}
+
+
+
+// ------------------------
+bool TreeWalker::remove()	{
+// ------------------------
+	// files and directories that have been left can go, their entry is in
+	// the directory currently being walked so no path lookup is needed
+	if(depth == 0 || (curEntry != WALK_FILE && curEntry != WALK_DIR_LEAVE))
+		return false;
+
+	// SdFat removes files opened for writing but refuses to open directories so
+	bool isFile = curEntry == WALK_FILE;
+	FatFile victim;
+	if(!victim.open(&dirs[depth - 1], curIndex, isFile ? O_RDWR : O_READ))
+		return false;
+
+	bool ret = isFile ? victim.remove() : victim.rmdir();
+	victim.close();
+	return ret;
+}
+
+
+
+// ------------------------
+bool TreeWalker::open(FatFile *file)	{
+// ------------------------
+	// a file's entry is in the directory being walked, no path lookup
+	if(depth == 0 || curEntry != WALK_FILE)
+		return false;
+
+	return file->open(&dirs[depth - 1], curIndex, O_READ);
+}
+
+
+
+// ------------------------
+void TreeWalker::end()	{
+// ------------------------
+	while(depth > 0)
+		dirs[--depth].close();
+}
@@ -0,0 +1,45 @@
+#ifndef TREEWALKER_H
+#define TREEWALKER_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+
+// deepest directory level a walk descends into
+#define WALK_MAX_DEPTH		8
+
+enum WalkEntry { WALK_FILE, WALK_DIR_ENTER, WALK_DIR_LEAVE, WALK_DIR_TOO_DEEP };
+
+// Iterative depth first walk over a directory subtree. Memory use is fixed:
+// one open directory per level, no recursion. Each call of next() does a
+// single directory step, so callers can yield or time slice between them.
+// Directories are reported when entered and again when left, after all
+// their children.
+class TreeWalker	{
+public:
+	bool begin(const String& root);
+	bool next();
+	bool remove();
+	void end();
+
+	WalkEntry entry()			{ return curEntry; }
+	const String& path()		{ return curPath; }
+	uint32_t size()				{ return curSize; }
+	// directory entry of a file or entered directory
+	const sdfat::DirFat_t& dirEntry()	{ return curDir; }
+	bool open(sdfat::FatFile *file);
+	// path below the walk root, starts with '/'
+	String relativePath()		{ return curPath.substring(rootLen); }
+
+protected:
+	sdfat::FatFile dirs[WALK_MAX_DEPTH];
+	uint8_t		depth = 0;
+	unsigned int rootLen = 0;
+	String		dirPath;
+	String		curPath;
+	WalkEntry	curEntry;
+	uint32_t	curSize;
+	sdfat::DirFat_t curDir;
+	uint16_t	curIndex;
+};
+
+#endif // TREEWALKER_H
@@ -0,0 +1,328 @@
+#include "UploadSpool.h"
+#include "CardVolume.h"
+#include "CardCache.h"
+#include "SidecarBuilder.h"
+#include "FreeSpace.h"
+#include "ChangeJournal.h"
+
+using namespace sdfat;
+
+UploadSpool uploadSpool;
+
+// ------------------------
+bool UploadSpool::begin()	{
+// ------------------------
+	if(mounted)
+		return true;
+	if(!LittleFS.begin())
+		return false;
+
+	// spool files left over from before a reset are still to be committed,
+	// a ".part" one was never received completely
+	LittleFS.mkdir(SPOOL_DIR);
+	Dir dir = LittleFS.openDir(SPOOL_DIR);
+	while(dir.next())	{
+		String name = dir.fileName();
+		if(name.endsWith(".part"))
+			LittleFS.remove(String(SPOOL_DIR "/") + name);
+		else	{
+			pending = true;
+			seq = max(seq, (uint32_t) strtoul(name.c_str(), NULL, 16) + 1);
+		}
+	}
+
+	mounted = true;
+	return true;
+}
+
+
+
+// ------------------------
+SpoolResult UploadSpool::create(fs::File *f, const String& target, size_t length)	{
+// ------------------------
+	// with the card at hand a missing folder is refused like on a direct
+	// upload, otherwise the commit finds out and drops the file
+	int slash = target.lastIndexOf('/');
+	if(cardVolume.isMounted() && slash > 0 && !cardVolume.volume().exists(target.substring(0, slash).c_str()))
+		return SPOOL_NO_FOLDER;
+
+	if(!begin())
+		return SPOOL_FULL;
+
+	// an unknown length is only found out to be too much while writing
+	FSInfo info;
+	if(!LittleFS.info(info) || info.usedBytes + length + target.length() + 1 + SPOOL_RESERVE_BLOCKS * info.blockSize > info.totalBytes)
+		return SPOOL_FULL;
+
+	// the name tells the order, received files are committed oldest first
+	char name[24];
+	sprintf(name, SPOOL_DIR "/%08x.part", seq++);
+	*f = LittleFS.open(name, "w");
+	if(!*f)
+		return SPOOL_FULL;
+
+	if(f->print(target) != target.length() || f->write('\n') != 1)	{
+		discard(f);
+		return SPOOL_FULL;
+	}
+	return SPOOL_OK;
+}
+
+
+
+// ------------------------
+bool UploadSpool::finish(fs::File *f)	{
+// ------------------------
+	String part = f->fullName();
+	f->close();
+
+	String name = part.substring(0, part.length() - 5);
+	if(!LittleFS.rename(part.c_str(), name.c_str()))	{
+		LittleFS.remove(part);
+		return false;
+	}
+
+	pending = true;
+	return true;
+}
+
+
+
+// ------------------------
+void UploadSpool::discard(fs::File *f)	{
+// ------------------------
+	String part = f->fullName();
+	f->close();
+	LittleFS.remove(part);
+}
+
+
+
+// ------------------------
+bool UploadSpool::isPending()	{
+// ------------------------
+	return pending || committing;
+}
+
+
+
+// ------------------------
+bool UploadSpool::isQueued(const String& target)	{
+// ------------------------
+	if(!mounted)
+		return false;
+
+	// files still being received count too, they are committed in order
+	Dir dir = LittleFS.openDir(SPOOL_DIR);
+	while(dir.next())	{
+		fs::File f = dir.openFile("r");
+		if(f && f.readStringUntil('\n') == target)
+			return true;
+	}
+	return false;
+}
+
+
+
+// ------------------------
+bool UploadSpool::wantsCard()	{
+// ------------------------
+	// mounting a missing card takes a while, don't try on every loop()
+	if(!pending || millis() - lastTry < SPOOL_RETRY_MS)
+		return false;
+
+	lastTry = millis();
+	return true;
+}
+
+
+
+// ------------------------
+void UploadSpool::step()	{
+// ------------------------
+	if(!committing && (!pending || millis() - failedAt < SPOOL_RETRY_MS || !nextSpool() || !beginCommit()))
+		return;
+
+	uint8_t buf[512];
+	uint32_t numToWrite = min((uint32_t) SPOOL_STEP_SECTORS, (length - numBlocks * 512 + 511) / 512);
+	SdCard *card = cardVolume.volume().card();
+
+	if(raw)
+		cardVolume.cache().invalidate(bgnBlock + numBlocks, numToWrite);
+	if(raw && numToWrite && !card->writeStart(bgnBlock + numBlocks))
+		return endCommit(false);
+
+	// the card leaves its multi block write on every error, or it would
+	// take no other command
+	for(uint32_t i = 0; i < numToWrite; i++)	{
+		// the last sector is padded, the file is truncated to its length at the end
+		size_t n = spool.read(buf, sizeof(buf));
+		bool ok = n > 0;
+		if(ok)	{
+			memset(buf + n, 0, sizeof(buf) - n);
+			ok = raw ? card->writeData(buf) : dst.write(buf, n) == n;
+		}
+		if(!ok)	{
+			if(raw)
+				card->writeStop();
+			return endCommit(false);
+		}
+		numBlocks++;
+	}
+
+	if(raw && numToWrite && !card->writeStop())
+		return endCommit(false);
+
+	if(numBlocks * 512 >= length)
+		endCommit(true);
+}
+
+
+
+// ------------------------
+void UploadSpool::cancel()	{
+// ------------------------
+	if(!committing)
+		return;
+
+	// a client may write or delete the target, the raw writes and the
+	// truncate would go to sectors that aren't the file's any more; the
+	// spool file stays and is committed from the start again, the target
+	// is still the old one
+	committing = false;
+	dst.remove();
+	spool.close();
+	cardChanged(target + SPOOL_SUFFIX);
+	Serial.print("Spooled upload interrupted: "); Serial.println(target);
+}
+
+
+
+// ------------------------
+bool UploadSpool::nextSpool()	{
+// ------------------------
+	// the oldest received file, names sort like their sequence numbers
+	String oldest;
+	Dir dir = LittleFS.openDir(SPOOL_DIR);
+	while(dir.next())	{
+		String name = dir.fileName();
+		if(!name.endsWith(".part") && (oldest.length() == 0 || name < oldest))
+			oldest = name;
+	}
+
+	if(oldest.length() == 0)	{
+		pending = false;
+		return false;
+	}
+
+	spool = LittleFS.open(String(SPOOL_DIR "/") + oldest, "r");
+	if(!spool)	{
+		pending = false;
+		return false;
+	}
+
+	target = spool.readStringUntil('\n');
+	length = spool.size() - spool.position();
+	return true;
+}
+
+
+
+// ------------------------
+bool UploadSpool::beginCommit()	{
+// ------------------------
+	// a copy left by an interrupted commit is started over
+	String tmpPath = target + SPOOL_SUFFIX;
+	cardVolume.volume().remove(tmpPath.c_str());
+
+	// like a PUT, a contiguous file takes raw sector writes
+	raw = length > 0 && dst.createContiguous(tmpPath.c_str(), (length/512 + 1) * 512) && dst.contiguousRange(&bgnBlock, &endBlock);
+	if(!raw)	{
+		dst.close();
+		if(!dst.open(tmpPath.c_str(), O_CREAT | O_WRITE | O_TRUNC))	{
+			// the target folder is gone, the upload can't go anywhere
+			drop();
+			cardChanged(tmpPath);
+			return false;
+		}
+	}
+
+	cardChanged(tmpPath);
+	numBlocks = 0;
+	committing = true;
+	return true;
+}
+
+
+
+// ------------------------
+void UploadSpool::endCommit(bool ok)	{
+// ------------------------
+	String tmpPath = target + SPOOL_SUFFIX;
+	committing = false;
+	if(ok && raw)
+		ok = dst.truncate(length);
+	if(ok)
+		ok = dst.close();
+
+	// switch over, the old file goes only once the copy is complete
+	SdFat& sd = cardVolume.volume();
+	uint32_t oldSize = 0;
+	bool removed = false;
+	FatFile old;
+	if(ok && old.open(target.c_str(), O_READ))	{
+		oldSize = old.fileSize();
+		old.close();
+		ok = removed = sd.remove(target.c_str());
+	}
+	if(ok)
+		ok = sd.rename(tmpPath.c_str(), target.c_str());
+
+	if(!ok)	{
+		if(removed)	{
+			freeSpace.resized(oldSize, 0);
+			changeJournal.record(CHANGE_DELETED, target);
+		}
+		// a spool file that can't be committed stays for the next few tries,
+		// then it goes so the ones behind it get their turn
+		if(dst.isOpen())
+			dst.remove();
+		else
+			sd.remove(tmpPath.c_str());
+		cardChanged(tmpPath);
+		cardChanged(target);
+		failedAt = millis();
+		if(++numTries < SPOOL_MAX_TRIES)
+			spool.close();
+		else
+			drop();
+		return;
+	}
+
+	freeSpace.resized(oldSize, length);
+	cardChanged(tmpPath);
+	cardChanged(target);
+	sidecarBuilder.drop(target);
+	changeJournal.record(CHANGE_WRITTEN, target);
+
+	String name = spool.fullName();
+	spool.close();
+	LittleFS.remove(name);
+	numTries = 0;
+	Serial.print("Spooled upload committed: "); Serial.println(target);
+}
+
+
+
+// ------------------------
+void UploadSpool::drop()	{
+// ------------------------
+	// the info page tells about uploads that never made it to the card
+	String name = spool.fullName();
+	spool.close();
+	LittleFS.remove(name);
+	numTries = 0;
+	dropped++;
+	lastDrop = target;
+	Serial.print("Spooled upload dropped: "); Serial.println(target);
+}
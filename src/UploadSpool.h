@@ -0,0 +1,78 @@
+#ifndef UPLOADSPOOL_H
+#define UPLOADSPOOL_H
+
+#include <Arduino.h>
+#include <SdFat.h>
+#include <LittleFS.h>
+
+// folder of the flash file system holding uploads not yet on the card
+#define SPOOL_DIR			"/spool"
+// flash blocks left free for LittleFS itself
+#define SPOOL_RESERVE_BLOCKS	4
+// sectors committed to the card per loop(), one multi block write each
+#define SPOOL_STEP_SECTORS	8
+// a card that could not be mounted for a commit is tried again after this
+#define SPOOL_RETRY_MS		5000
+// a commit that failed this often is given up, the card is full or broken
+#define SPOOL_MAX_TRIES		3
+// a commit is written under the target's name with this appended
+#define SPOOL_SUFFIX		".spool~"
+
+enum SpoolResult { SPOOL_OK, SPOOL_FULL, SPOOL_NO_FOLDER };
+
+// Uploads received while the printer has the card are stored in the
+// LittleFS area of the flash first. Each spool file starts with its target
+// path on a line of its own. Once the card is ours again they are written
+// to it oldest first, a few sectors per loop() with raw multi block writes.
+// The data goes to a copy next to the target, which replaces the target
+// only once it is complete.
+// A commit that fails is tried again a few times and then dropped, so a
+// full card doesn't hold up the uploads behind it; the info page tells.
+// A commit that a client interrupts starts over, and later uploads to a
+// path still in the spool queue up behind it so they are not overwritten.
+class UploadSpool	{
+public:
+	bool begin();
+	SpoolResult create(fs::File *f, const String& target, size_t length);
+	bool finish(fs::File *f);
+	void discard(fs::File *f);
+
+	bool isPending();
+	bool isQueued(const String& target);
+	bool wantsCard();
+	bool isCommitting()			{ return committing; }
+	uint32_t numDropped()		{ return dropped; }
+	const String& lastDropped()	{ return lastDrop; }
+	void step();
+	void cancel();
+
+protected:
+	bool nextSpool();
+	bool beginCommit();
+	void endCommit(bool ok);
+	void drop();
+
+	bool		mounted = false;
+	bool		pending = false;
+	bool		committing = false;
+	uint32_t	seq = 0;
+	uint32_t	lastTry = 0;
+	uint32_t	failedAt = (uint32_t) -SPOOL_RETRY_MS;	// last commit that failed
+	uint8_t		numTries = 0;			// failed commits of the oldest spool file
+	uint32_t	dropped = 0;
+	String		lastDrop;
+
+	// commit in progress
+	fs::File	spool;
+	String		target;
+	sdfat::FatFile dst;
+	uint32_t	length;
+	uint32_t	bgnBlock;
+	uint32_t	endBlock;
+	uint32_t	numBlocks;
+	bool		raw;
+};
+
+extern UploadSpool uploadSpool;
+
+#endif // UPLOADSPOOL_H
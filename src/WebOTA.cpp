@@ -2,6 +2,9 @@
 
 #include "WebOTA.h"
 #include "Version.h"
+#include "CardVolume.h"
+#include "Defragmenter.h"
+#include "UploadSpool.h"
 #include <Arduino.h>
 #include <WiFiClient.h>
 
@@ -159,6 +162,14 @@ int WebOTA::add_http_routes(WebServer *server, const char *path) {
 		html += "<li>FTP at port 21 (FileZilla is supported)<br>ftp://" + localIP + "</li><br>";
 		html += "<li>Firmware update<br><a href=\"http://" + localIP + "/webota\">http://" + localIP + "/webota</a></li><br>";
 		html += "</ul>";
+		if (cardVolume.clock())
+			html += "SD card SPI clock: " + String(cardVolume.clock() / 1000) + " kHz, reads at " + String(cardVolume.readSpeed()) + " KB/s<br>";
+		if (cardVolume.cache().hits() || cardVolume.cache().misses())
+			html += "SD sector cache: " + String(cardVolume.cache().hits()) + " hits, " + String(cardVolume.cache().misses()) + " misses<br>";
+		if (defragmenter.numFiles())
+			html += "Defragmented: " + String(defragmenter.numFiles()) + " files, " + String(defragmenter.numBytes() / 1024) + " KB<br>";
+		if (uploadSpool.numDropped())
+			html += "Spooled uploads that could not be written to the SD card: " + String(uploadSpool.numDropped()) + ", the last one " + uploadSpool.lastDropped() + "<br>";
 		html += "<br>";
 		html += "<br>";
 		html += "HINT: The BTT TF Cloud V1.0 device supports up to 32 GB microSD/TF cards.";
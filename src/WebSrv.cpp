@@ -1,41 +1,26 @@
 #include "ESPWebDAV.h"
 
+uint8_t DavConnection::numWaiting = 0;
+
 // Sections are copied from ESP8266Webserver
 
 // ------------------------
-String ESPWebDAV::getMimeType(String path) {
-// ------------------------
-	if(path.endsWith(".html")) return "text/html";
-	else if(path.endsWith(".htm")) return "text/html";
-	else if(path.endsWith(".css")) return "text/css";
-	else if(path.endsWith(".txt")) return "text/plain";
-	else if(path.endsWith(".js")) return "application/javascript";
-	else if(path.endsWith(".json")) return "application/json";
-	else if(path.endsWith(".png")) return "image/png";
-	else if(path.endsWith(".gif")) return "image/gif";
-	else if(path.endsWith(".jpg")) return "image/jpeg";
-	else if(path.endsWith(".ico")) return "image/x-icon";
-	else if(path.endsWith(".svg")) return "image/svg+xml";
-	else if(path.endsWith(".ttf")) return "application/x-font-ttf";
-	else if(path.endsWith(".otf")) return "application/x-font-opentype";
-	else if(path.endsWith(".woff")) return "application/font-woff";
-	else if(path.endsWith(".woff2")) return "application/font-woff2";
-	else if(path.endsWith(".eot")) return "application/vnd.ms-fontobject";
-	else if(path.endsWith(".sfnt")) return "application/font-sfnt";
-	else if(path.endsWith(".xml")) return "text/xml";
-	else if(path.endsWith(".pdf")) return "application/pdf";
-	else if(path.endsWith(".zip")) return "application/zip";
-	else if(path.endsWith(".gz")) return "application/x-gzip";
-	else if(path.endsWith(".appcache")) return "text/cache-manifest";
-
-	return "application/octet-stream";
+const char *DavConnection::getMimeType(const String& path) {
+// ------------------------
+	// only the part after the last dot of the last path segment is compared
+	int dot = path.lastIndexOf('.');
+	if(dot < 0 || path.indexOf('/', dot) >= 0)
+		return "application/octet-stream";
+
+	const char *type = lookupMimeType(path.c_str() + dot + 1);
+	return type ? type : "application/octet-stream";
 }
 
 
 
 
 // ------------------------
-String ESPWebDAV::urlDecode(const String& text)	{
+String DavConnection::urlDecode(const String& text)	{
 // ------------------------
 	String decoded = "";
 	char temp[] = "0x00";
@@ -65,7 +50,7 @@ String ESPWebDAV::urlDecode(const String& text)	{
 
 
 // ------------------------
-String ESPWebDAV::urlToUri(String url)	{
+String DavConnection::urlToUri(String url)	{
 // ------------------------
 	if(url.startsWith("http://"))	{
 		int uriStart = url.indexOf('/', 7);
@@ -87,9 +72,14 @@ bool ESPWebDAV::isClientWaiting() {
 
 
 // ------------------------
-void ESPWebDAV::handleClient(String blank) {
+void ESPWebDAV::handleClient() {
 // ------------------------
-	processClient(&ESPWebDAV::handleRequest, blank);
+	acceptClient("");
+
+	// give every open connection a slice
+	for(int i = 0; i < WEBDAV_MAX_CONNECTIONS; i++)
+		if(!conns[i].isFree())
+			conns[i].process();
 }
 
 
@@ -97,60 +87,354 @@ void ESPWebDAV::handleClient(String blank) {
 // ------------------------
 void ESPWebDAV::rejectClient(String rejectMessage) {
 // ------------------------
-	processClient(&ESPWebDAV::handleReject, rejectMessage);
+	acceptClient(rejectMessage);
+
+	for(int i = 0; i < WEBDAV_MAX_CONNECTIONS; i++)
+		if(!conns[i].isFree())
+			conns[i].process();
 }
 
 
 
 // ------------------------
-void ESPWebDAV::processClient(THandlerFunction handler, String message) {
+bool ESPWebDAV::isIdle() {
+// ------------------------
+	// change watchers may wait for minutes, the card is free meanwhile
+	for(int i = 0; i < WEBDAV_MAX_CONNECTIONS; i++)
+		if(!conns[i].isFree() && !conns[i].isWaiting())
+			return false;
+
+	return !server->hasClient();
+}
+
+
+
 // ------------------------
-	// Check if a client has connected
-	client = server->available();
-	if(!client)
+void ESPWebDAV::acceptClient(const String& message) {
+// ------------------------
+	if(!server->hasClient())
 		return;
 
-	// Wait until the client sends some data
-	while(!client.available())
-		delay(1);
-	
+	// clients stay in the listen backlog until a connection is free
+	for(int i = 0; i < WEBDAV_MAX_CONNECTIONS; i++)	{
+		if(conns[i].isFree())	{
+			conns[i].begin(&cardVolume.volume(), server->available(), message);
+			return;
+		}
+	}
+}
+
+
+
+// ------------------------
+void DavConnection::begin(sdfat::SdFat *card, WiFiClient newClient, const String& message) {
+// ------------------------
+	sd = card;
+	client = newClient;
+	rejectMessage = message;
+	state = CONN_REQUEST;
+	lastActivity = millis();
+
 	// reset all variables
 	_chunked = false;
 	_responseHeaders = String();
 	_contentLength = CONTENT_LENGTH_NOT_SET;
+	lineBuf = String();
+	headersDone = false;
 	method = String();
+	methodId = METHOD_UNKNOWN;
 	uri = String();
+	query = String();
+	resource = RESOURCE_NONE;
 	contentLengthHeader = String();
 	depthHeader = String();
 	hostHeader = String();
 	destinationHeader = String();
+	transferEncodingHeader = String();
+	expectedLengthHeader = String();
+	overwriteHeader = String();
+	rangeHeader = String();
+	acceptEncodingHeader = String();
+	failures = String();
+	numFailures = 0;
+	propCaching = false;
+	propReplay = false;
+	delete gzip;
+	gzip = NULL;
+}
+
+
+
+// ------------------------
+void DavConnection::process() {
+// ------------------------
+	uint32_t sliceStart = millis();
+
+	if(state == CONN_REQUEST)	{
+		// extract uri, headers etc as they arrive
+		if(!headersDone)
+			headersDone = readRequest();
+
+		if(state == CONN_FREE)
+			return;
+
+		if(headersDone && isBodyReady())	{
+			// invoke the handler, long transfers leave a job behind
+			THandlerFunction handler = rejectMessage.length() ? &DavConnection::handleReject : &DavConnection::handleRequest;
+			(this->*handler)(rejectMessage);
+			lastActivity = millis();
+
+			if(job == JOB_NONE)
+				return finish();
+		}
+		else if(!client.connected() && !client.available())	{
+			// client went away before sending the whole request
+			return abort();
+		}
+	}
+	else	{
+		// run the job until the slice is used up or it has to wait for the client
+		bool progress = true;
+		while(job != JOB_NONE && progress && (millis() - sliceStart) < WEBDAV_SLICE_MS)	{
+			switch(job)	{
+			case JOB_GET:		progress = stepGet(); break;
+			case JOB_PUT:		progress = stepPut(); break;
+			case JOB_PROPFIND:	progress = stepPropFind(); break;
+			case JOB_COPY:		progress = stepCopy(); break;
+			case JOB_DELETE:	progress = stepDelete(); break;
+			case JOB_EXTRACT:	progress = stepExtract(); break;
+			case JOB_ARCHIVE:	progress = stepArchive(); break;
+			case JOB_CHANGES:	progress = stepChanges(); break;
+			case JOB_DRAIN:		progress = stepDrain(); break;
+			default:			progress = false; break;
+			}
+
+			if(progress)
+				lastActivity = millis();
+		}
+
+		// the card is shared, multi block transfers don't outlive a slice
+		endCardTransfer();
+
+		if(state == CONN_FREE)
+			return;
+
+		if(job == JOB_NONE)
+			return finish();
+	}
+
+	if((millis() - lastActivity) > WEBDAV_CONN_TIMEOUT)	{
+		DBG_PRINTLN("Connection timed out");
+		abort();
+	}
+}
+
+
+
+// ------------------------
+bool DavConnection::readRequest() {
+// ------------------------
+	// collect lines without waiting, the request line comes first
+	while(client.available())	{
+		char c = client.read();
+		lastActivity = millis();
+
+		if(c == '\r')
+			continue;
+
+		if(c != '\n')	{
+			if(lineBuf.length() < HTTP_MAX_LINE)
+				lineBuf += c;
+			continue;
+		}
+
+		if(method.length() == 0)	{
+			// skip empty lines in front of the request
+			if(lineBuf.length() && !parseRequestLine(lineBuf))	{
+				abort();
+				return false;
+			}
+		}
+		else if(lineBuf.length() == 0)	{
+			// no more headers
+			return true;
+		}
+		else
+			parseHeader(lineBuf);
+
+		lineBuf = "";
+	}
+
+	return false;
+}
+
+
+
+// ------------------------
+bool DavConnection::openPath(sdfat::FatFile *f, const String& path, sdfat::oflag_t oflag) {
+// ------------------------
+	// large directories answer from their name index, misses without a scan
+	int8_t found = nameIndex.open(f, path, oflag);
+	if(found >= 0)
+		return found;
+
+	return f->open(path.c_str(), oflag);
+}
+
+
+
+// ------------------------
+bool DavConnection::openCached(const String& path, sdfat::FatFile *f, FileMap *fMap) {
+// ------------------------
+	// repeated and segmented downloads reuse the handle and its cluster map
+	if(fileCache.open(path, f, fMap))
+		return true;
+
+	if(!openPath(f, path, O_READ))
+		return false;
+
+	// directories are opened as well but not kept
+	fMap->clear();
+	if(f->isFile())	{
+		fMap->begin(f);
+		fMap->extend(f, FILEMAP_OPEN_SECTORS);
+		fileCache.add(path, f, fMap);
+	}
+	return true;
+}
+
+
+
+// ------------------------
+bool DavConnection::isBodyReady() {
+// ------------------------
+	// PUT bodies are streamed by the job, small bodies are read in one go
+	if(methodId == METHOD_PUT)
+		return true;
 
-	// extract uri, headers etc
-	if(parseRequest())
-		// invoke the handler
-		(this->*handler)(message);
-		
+	size_t contentLen = contentLengthHeader.toInt();
+	return contentLen == 0 || contentLen > HTTP_MAX_SMALL_BODY || (size_t) client.available() >= contentLen;
+}
+
+
+
+// ------------------------
+void DavConnection::finish() {
+// ------------------------
 	// finalize the response
 	if(_chunked)
 		sendContent("");
 
+	// the resource stays open while the request is served
+	file.close();
+
 	// send all data before closing connection
 	client.flush();
 	// close the connection
 	client.stop();
+	state = CONN_FREE;
 }
 
 
 
+// ------------------------
+void DavConnection::abort() {
+// ------------------------
+	endCardTransfer();
+
+	// don't leave half written files behind
+	if(job == JOB_PUT && spooled)
+		uploadSpool.discard(&spoolFile);
+	else if(job == JOB_PUT)	{
+		file.close();
+		sd->remove(uri.c_str());
+		freeSpace.resized(resourceSize, 0);
+	}
+	else if(job == JOB_COPY && dFile.isOpen())	{
+		freeSpace.resized(dFile.fileSize(), 0);
+		dFile.remove();
+	}
+	else if(job == JOB_EXTRACT)
+		extractor->abort();
+
+	endJob();
+	delete gzip;
+	gzip = NULL;
+	client.stop();
+	state = CONN_FREE;
+}
+
 
 
 // ------------------------
-bool ESPWebDAV::parseRequest() {
+void DavConnection::startJob(JobType newJob, ConnState newState, size_t newBufSize) {
+// ------------------------
+	job = newJob;
+	state = newState;
+	tStart = millis();
+	cardReading = false;
+	cardWriting = false;
+
+	bufSize = newBufSize;
+	if(bufSize)
+		buf = (uint8_t *) malloc(bufSize);
+}
+
+
+
+// ------------------------
+void DavConnection::endJob() {
+// ------------------------
+	// the listings may have been read while the job changed the card
+	if(job == JOB_PUT || job == JOB_COPY || job == JOB_DELETE || job == JOB_EXTRACT)
+		invalidateCaches();
+	if(job == JOB_CHANGES)
+		numWaiting--;
+
+	job = JOB_NONE;
+	propCaching = false;
+	propReplay = false;
+	propBody = String();
+
+	delete building;
+	building = NULL;
+
+	free(buf);
+	buf = NULL;
+
+	delete walker;
+	walker = NULL;
+
+	delete extractor;
+	extractor = NULL;
+
+	// removes the temporary file of a zip
+	delete archive;
+	archive = NULL;
+
+	file.close();
+	dFile.close();
+}
+
+
+
+// ------------------------
+void DavConnection::endCardTransfer() {
+// ------------------------
+	if(cardReading)
+		sd->card()->readStop();
+	if(cardWriting)
+		sd->card()->writeStop();
+
+	cardReading = false;
+	cardWriting = false;
+}
+
+
+
+// ------------------------
+bool DavConnection::parseRequestLine(const String& req) {
 // ------------------------
-	// Read the first line of HTTP request
-	String req = client.readStringUntil('\r');
-	client.readStringUntil('\n');
-	
 	// First line of HTTP request looks like "GET /path HTTP/1.1"
 	// Retrieve the "/path" part by finding the spaces
 	int addr_start = req.indexOf(' ');
@@ -160,46 +444,57 @@ bool ESPWebDAV::parseRequest() {
 	}
 
 	method = req.substring(0, addr_start);
-	uri = urlDecode(req.substring(addr_start + 1, addr_end));
-	// DBG_PRINT("method: "); DBG_PRINT(method); DBG_PRINT(" url: "); DBG_PRINTLN(uri);
-	
-	// parse and finish all headers
-	String headerName;
-	String headerValue;
-	
-	while(1) {
-		req = client.readStringUntil('\r');
-		client.readStringUntil('\n');
-		if(req == "") 
-			// no more headers
-			break;
-			
-		int headerDiv = req.indexOf(':');
-		if (headerDiv == -1)
-			break;
-		
-		headerName = req.substring(0, headerDiv);
-		headerValue = req.substring(headerDiv + 2);
-		// DBG_PRINT("\t"); DBG_PRINT(headerName); DBG_PRINT(": "); DBG_PRINTLN(headerValue);
-		
-		if(headerName.equalsIgnoreCase("Host"))
-			hostHeader = headerValue;
-		else if(headerName.equalsIgnoreCase("Depth"))
-			depthHeader = headerValue;
-		else if(headerName.equalsIgnoreCase("Content-Length"))
-			contentLengthHeader = headerValue;
-		else if(headerName.equalsIgnoreCase("Destination"))
-			destinationHeader = headerValue;
+	methodId = parseMethod(method.c_str());
+	String url = req.substring(addr_start + 1, addr_end);
+	int queryStart = url.indexOf('?');
+	if(queryStart != -1)	{
+		query = url.substring(queryStart + 1);
+		url.remove(queryStart);
 	}
-	
+	uri = urlDecode(url);
+	// DBG_PRINT("method: "); DBG_PRINT(method); DBG_PRINT(" url: "); DBG_PRINTLN(uri);
 	return true;
 }
 
 
 
+// ------------------------
+void DavConnection::parseHeader(const String& req) {
+// ------------------------
+	int headerDiv = req.indexOf(':');
+	if (headerDiv == -1)
+		return;
+
+	String headerName = req.substring(0, headerDiv);
+	String headerValue = req.substring(headerDiv + 2);
+	// DBG_PRINT("\t"); DBG_PRINT(headerName); DBG_PRINT(": "); DBG_PRINTLN(headerValue);
+
+	if(headerName.equalsIgnoreCase("Host"))
+		hostHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Depth"))
+		depthHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Content-Length"))
+		contentLengthHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Destination"))
+		destinationHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Transfer-Encoding"))
+		transferEncodingHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("X-Expected-Entity-Length"))
+		expectedLengthHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Overwrite"))
+		overwriteHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Range"))
+		rangeHeader = headerValue;
+	else if(headerName.equalsIgnoreCase("Accept-Encoding"))
+		acceptEncodingHeader = headerValue;
+}
+
+
+
+
 
 // ------------------------
-void ESPWebDAV::sendHeader(const String& name, const String& value, bool first) {
+void DavConnection::sendHeader(const String& name, const String& value, bool first) {
 // ------------------------
 	String headerLine = name + ": " + value + "\r\n";
 
@@ -212,7 +507,7 @@ void ESPWebDAV::sendHeader(const String& name, const String& value, bool first)
 
 
 // ------------------------
-void ESPWebDAV::send(String code, const char* content_type, const String& content) {
+void DavConnection::send(String code, const char* content_type, const String& content) {
 // ------------------------
 	String header;
 	_prepareHeader(header, code, content_type, content.length());
@@ -225,7 +520,7 @@ void ESPWebDAV::send(String code, const char* content_type, const String& conten
 
 
 // ------------------------
-void ESPWebDAV::_prepareHeader(String& response, String code, const char* content_type, size_t contentLength) {
+void DavConnection::_prepareHeader(String& response, String code, const char* content_type, size_t contentLength) {
 // ------------------------
 	response = "HTTP/1.1 " + code + "\r\n";
 
@@ -250,10 +545,42 @@ void ESPWebDAV::_prepareHeader(String& response, String code, const char* conten
 
 
 // ------------------------
-void ESPWebDAV::sendContent(const String& content) {
+void DavConnection::sendContent(const String& content) {
 // ------------------------
-	const char * footer = "\r\n";
 	size_t size = content.length();
+
+	// record a listing for the PROPFIND cache, give up on big ones
+	if(propCaching)	{
+		if(propBody.length() + size > PROPCACHE_MAX_ENTRY)	{
+			propCaching = false;
+			propBody = String();
+		}
+		else
+			propBody += content;
+	}
+
+	// a compressed response goes out as the encoder fills its buffer
+	if(gzip)	{
+		if(size)	{
+			gzip->write((const uint8_t *) content.c_str(), size);
+			return;
+		}
+
+		gzip->finish();
+		DBG_PRINT("gzip "); DBG_PRINT(gzip->totalIn); DBG_PRINT(" -> "); DBG_PRINT(gzip->totalOut); DBG_PRINT(" bytes in "); DBG_PRINT(gzip->busyMicros); DBG_PRINTLN(" us");
+		delete gzip;
+		gzip = NULL;
+	}
+
+	sendChunk(content.c_str(), size);
+}
+
+
+
+// ------------------------
+void DavConnection::sendChunk(const char *content, size_t size) {
+// ------------------------
+	const char * footer = "\r\n";
 	
 	if(_chunked) {
 		char * chunkSize = (char *) malloc(11);
@@ -264,7 +591,7 @@ void ESPWebDAV::sendContent(const String& content) {
 		}
 	}
 	
-	client.write(content.c_str(), size);
+	client.write(content, size);
 	
 	if(_chunked) {
 		client.write(footer, 2);
@@ -277,7 +604,7 @@ void ESPWebDAV::sendContent(const String& content) {
 
 
 // ------------------------
-void ESPWebDAV::sendContent_P(PGM_P content) {
+void DavConnection::sendContent_P(PGM_P content) {
 // ------------------------
 	const char * footer = "\r\n";
 	size_t size = strlen_P(content);
@@ -304,14 +631,14 @@ void ESPWebDAV::sendContent_P(PGM_P content) {
 
 
 // ------------------------
-void ESPWebDAV::setContentLength(size_t len)	{
+void DavConnection::setContentLength(size_t len)	{
 // ------------------------
 	_contentLength = len;
 }
 
 
 // ------------------------
-size_t ESPWebDAV::readBytesWithTimeout(uint8_t *buf, size_t bufSize) {
+size_t DavConnection::readBytesWithTimeout(uint8_t *buf, size_t bufSize) {
 // ------------------------
 	int timeout_ms = HTTP_MAX_POST_WAIT;
 	size_t numAvailable = 0;
@@ -326,7 +653,7 @@ size_t ESPWebDAV::readBytesWithTimeout(uint8_t *buf, size_t bufSize) {
 
 
 // ------------------------
-size_t ESPWebDAV::readBytesWithTimeout(uint8_t *buf, size_t bufSize, size_t numToRead) {
+size_t DavConnection::readBytesWithTimeout(uint8_t *buf, size_t bufSize, size_t numToRead) {
 // ------------------------
 	int timeout_ms = HTTP_MAX_POST_WAIT;
 	size_t numAvailable = 0;
@@ -341,3 +668,22 @@ size_t ESPWebDAV::readBytesWithTimeout(uint8_t *buf, size_t bufSize, size_t numT
 }
 
 
+
+
+// ------------------------
+bool DavConnection::parseChunkSize(const String& line, size_t *chunkSize) {
+// ------------------------
+	// chunk header looks like "1f4[;ext=value]"
+	String size = line;
+	int extDiv = size.indexOf(';');
+	if(extDiv != -1)
+		size = size.substring(0, extDiv);
+	size.trim();
+
+	if(size.length() == 0)
+		return false;
+
+	char *end;
+	*chunkSize = strtoul(size.c_str(), &end, 16);
+	return *end == 0;
+}